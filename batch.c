@@ -0,0 +1,363 @@
+#include "internal.h"
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/*
+ * Queue unlinkat() calls made during a walk and hand them to the kernel
+ * in batches through io_uring, instead of making one system call per file.
+ * Each thread has its own ring. The caller must batch_flush() before it
+ * closes a directory descriptor that queued operations refer to, and
+ * before anything that depends on them having been done, such as removing
+ * the directory itself. If io_uring can't be had, the calls are made
+ * synchronously as they are queued.
+ */
+
+#define	BATCH_ENTRIES	256
+
+struct Operation {
+	int		fd;
+	int		flags;
+	int		force;
+	int		name;			/* Offsets into Batch.strings */
+	int		path;
+};
+
+struct Batch {
+	int					ring;
+	unsigned *			sqHead;
+	unsigned *			sqTail;
+	unsigned *			sqMask;
+	unsigned *			sqArray;
+	struct io_uring_sqe *	sqes;
+	unsigned *			cqHead;
+	unsigned *			cqTail;
+	unsigned *			cqMask;
+	struct io_uring_cqe *	cqes;
+	void *				sqMap;
+	size_t				sqMapSize;
+	void *				cqMap;
+	size_t				cqMapSize;
+	size_t				sqesSize;
+	struct Operation	operations[BATCH_ENTRIES];
+	int					count;
+	char *				strings;
+	int					stringsLength;
+	int					stringsSize;
+};
+
+static int				unavailable = 0;
+static __thread struct Batch *	batch = 0;
+
+static int
+supports_unlinkat(int ring)
+{
+	struct io_uring_probe *	p;
+	int						supported = 0;
+
+	p = calloc(1, sizeof(*p) + 256 * sizeof(struct io_uring_probe_op));
+	if ( p == 0 )
+		return 0;
+	if ( syscall(__NR_io_uring_register, ring, IORING_REGISTER_PROBE, p, 256) == 0
+	 && p->last_op >= IORING_OP_UNLINKAT
+	 && (p->ops[IORING_OP_UNLINKAT].flags & IO_URING_OP_SUPPORTED) )
+		supported = 1;
+	free(p);
+	return supported;
+}
+
+static struct Batch *
+open_batch(void)
+{
+	struct io_uring_params	p;
+	struct Batch *			b;
+	char *					sq;
+	char *					cq;
+
+	if ( unavailable )
+		return 0;
+
+	memset(&p, 0, sizeof(p));
+	if ( (b = calloc(1, sizeof(*b))) == 0 )
+		return 0;
+	if ( (b->ring = syscall(__NR_io_uring_setup, BATCH_ENTRIES, &p)) < 0 ) {
+		free(b);
+		unavailable = 1;
+		return 0;
+	}
+	if ( !supports_unlinkat(b->ring) ) {
+		close(b->ring);
+		free(b);
+		unavailable = 1;
+		return 0;
+	}
+
+	b->sqMapSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	b->cqMapSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if ( p.features & IORING_FEAT_SINGLE_MMAP ) {
+		if ( b->cqMapSize > b->sqMapSize )
+			b->sqMapSize = b->cqMapSize;
+		b->cqMapSize = 0;
+	}
+	b->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	b->sqMap = mmap(0, b->sqMapSize, PROT_READ|PROT_WRITE
+	 ,MAP_SHARED|MAP_POPULATE, b->ring, IORING_OFF_SQ_RING);
+	if ( b->cqMapSize )
+		b->cqMap = mmap(0, b->cqMapSize, PROT_READ|PROT_WRITE
+		 ,MAP_SHARED|MAP_POPULATE, b->ring, IORING_OFF_CQ_RING);
+	else
+		b->cqMap = b->sqMap;
+	b->sqes = mmap(0, b->sqesSize, PROT_READ|PROT_WRITE
+	 ,MAP_SHARED|MAP_POPULATE, b->ring, IORING_OFF_SQES);
+
+	if ( b->sqMap == MAP_FAILED
+	 || b->cqMap == MAP_FAILED
+	 || b->sqes == MAP_FAILED ) {
+		if ( b->sqMap != MAP_FAILED )
+			munmap(b->sqMap, b->sqMapSize);
+		if ( b->cqMapSize && b->cqMap != MAP_FAILED )
+			munmap(b->cqMap, b->cqMapSize);
+		if ( b->sqes != MAP_FAILED )
+			munmap(b->sqes, b->sqesSize);
+		close(b->ring);
+		free(b);
+		unavailable = 1;
+		return 0;
+	}
+
+	sq = (char *)b->sqMap;
+	cq = (char *)b->cqMap;
+	b->sqHead = (unsigned *)(sq + p.sq_off.head);
+	b->sqTail = (unsigned *)(sq + p.sq_off.tail);
+	b->sqMask = (unsigned *)(sq + p.sq_off.ring_mask);
+	b->sqArray = (unsigned *)(sq + p.sq_off.array);
+	b->cqHead = (unsigned *)(cq + p.cq_off.head);
+	b->cqTail = (unsigned *)(cq + p.cq_off.tail);
+	b->cqMask = (unsigned *)(cq + p.cq_off.ring_mask);
+	b->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return b;
+}
+
+static int
+save_string(struct Batch * b, const char * s)
+{
+	int	length = strlen(s) + 1;
+	int	offset = b->stringsLength;
+
+	if ( b->stringsLength + length > b->stringsSize ) {
+		int		size = b->stringsSize ? b->stringsSize * 2 : 16384;
+		char *	strings;
+
+		while ( size < b->stringsLength + length )
+			size *= 2;
+		if ( (strings = realloc(b->strings, size)) == 0 )
+			return -1;
+		b->strings = strings;
+		b->stringsSize = size;
+	}
+	memcpy(&b->strings[offset], s, length);
+	b->stringsLength += length;
+	return offset;
+}
+
+static int
+complete(struct Batch * b, struct Operation * op, int result)
+{
+	if ( result < 0 && result != -ENOENT && !op->force ) {
+		errno = -result;
+		name_and_error(&b->strings[op->path]);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Do the batch, from operation "first" on, the slow way, when the kernel
+ * won't take it.
+ */
+static int
+run_synchronously(struct Batch * b, int first)
+{
+	int	status = 0;
+	int	n;
+
+	for ( n = first; n < b->count; n++ ) {
+		struct Operation *	op = &b->operations[n];
+		int	result = 0;
+
+		if ( unlinkat(op->fd, &b->strings[op->name], op->flags) != 0 )
+			result = -errno;
+		if ( complete(b, op, result) != 0 )
+			status = 1;
+	}
+	return status;
+}
+
+static int
+reap(struct Batch * b, int * completed)
+{
+	unsigned	head = *b->cqHead;
+	int			status = 0;
+
+	while ( head != __atomic_load_n(b->cqTail, __ATOMIC_ACQUIRE) ) {
+		struct io_uring_cqe *	cqe = &b->cqes[head & *b->cqMask];
+
+		if ( complete(b, &b->operations[cqe->user_data], cqe->res) != 0 )
+			status = 1;
+		(*completed)++;
+		head++;
+	}
+	__atomic_store_n(b->cqHead, head, __ATOMIC_RELEASE);
+	return status;
+}
+
+static void
+close_batch(struct Batch * b)
+{
+	munmap(b->sqes, b->sqesSize);
+	if ( b->cqMapSize )
+		munmap(b->cqMap, b->cqMapSize);
+	munmap(b->sqMap, b->sqMapSize);
+	close(b->ring);
+	free(b->strings);
+	free(b);
+}
+
+extern int
+batch_flush(void)
+{
+	struct Batch *	b = batch;
+	unsigned		tail;
+	int				submitted = 0;
+	int				completed = 0;
+	int				status = 0;
+	int				n;
+
+	if ( b == 0 || b->count == 0 )
+		return 0;
+
+	tail = *b->sqTail;
+	for ( n = 0; n < b->count; n++ ) {
+		struct Operation *		op = &b->operations[n];
+		unsigned				index = (tail + n) & *b->sqMask;
+		struct io_uring_sqe *	sqe = &b->sqes[index];
+
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = IORING_OP_UNLINKAT;
+		sqe->fd = op->fd;
+		sqe->addr = (unsigned long)&b->strings[op->name];
+		sqe->unlink_flags = op->flags;
+		sqe->user_data = n;
+		b->sqArray[index] = index;
+	}
+	__atomic_store_n(b->sqTail, tail + b->count, __ATOMIC_RELEASE);
+
+	while ( completed < b->count ) {
+		int	result;
+
+		result = syscall(__NR_io_uring_enter, b->ring
+		 ,b->count - submitted, b->count - completed
+		 ,IORING_ENTER_GETEVENTS, 0, 0);
+		if ( result < 0 ) {
+			if ( errno == EINTR )
+				continue;
+			/*
+			 * Take back the entries the kernel didn't take, and do them
+			 * here. Those it did take must complete before the ring is
+			 * used again, or their results would be matched against
+			 * the next batch's operations.
+			 */
+			__atomic_store_n(b->sqTail, tail + submitted, __ATOMIC_RELEASE);
+			if ( run_synchronously(b, submitted) != 0 )
+				status = 1;
+			while ( completed < submitted ) {
+				if ( syscall(__NR_io_uring_enter, b->ring, 0
+				 ,submitted - completed, IORING_ENTER_GETEVENTS, 0, 0) < 0 ) {
+					if ( errno == EINTR )
+						continue;
+					/* Their results are lost. Give up on the ring. */
+					name_and_error("io_uring_enter");
+					close_batch(b);
+					batch = 0;
+					unavailable = 1;
+					return 1;
+				}
+				if ( reap(b, &completed) != 0 )
+					status = 1;
+			}
+			break;
+		}
+		submitted += result;
+		if ( reap(b, &completed) != 0 )
+			status = 1;
+	}
+
+	b->count = 0;
+	b->stringsLength = 0;
+	return status;
+}
+
+/*
+ * Remove the file named by "i", as unlinkat(i->directoryFd, i->name, flags)
+ * would. Errors other than the file already being gone are reported, but
+ * possibly not until the next batch_flush().
+ */
+extern int
+batch_unlink(const struct FileInfo * i, int flags)
+{
+	struct Batch *		b;
+	struct Operation *	op;
+	int					status = 0;
+
+	if ( batch == 0 )
+		batch = open_batch();
+
+	if ( (b = batch) != 0 && b->count == BATCH_ENTRIES )
+		status = batch_flush();
+
+	if ( b != 0 ) {
+		int	name = save_string(b, i->name);
+		int	path = save_string(b, i->source);
+
+		if ( name >= 0 && path >= 0 ) {
+			op = &b->operations[b->count++];
+			op->fd = i->directoryFd;
+			op->flags = flags;
+			op->force = i->options->force;
+			op->name = name;
+			op->path = path;
+			return status;
+		}
+	}
+
+	if ( unlinkat(i->directoryFd, i->name, flags) != 0
+	 && errno != ENOENT && !i->options->force ) {
+		name_and_error(i->source);
+		return 1;
+	}
+	return status;
+}
+
+/*
+ * Let go of this thread's ring. Anything still queued is done first.
+ */
+extern int
+batch_release(void)
+{
+	struct Batch *	b = batch;
+	int				status;
+
+	if ( b == 0 )
+		return 0;
+
+	status = batch_flush();
+	if ( (b = batch) != 0 )
+		close_batch(b);
+	batch = 0;
+	return status;
+}
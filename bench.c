@@ -0,0 +1,648 @@
+#include "internal.h"
+#include "tarfn.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <utmp.h>
+#include <sys/param.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+const char	bbbench_usage[] = "bbbench [-d directory] [-n files] [-s size] [-b size] [-r runs]"
+" [benchmark ...]\n"
+"\n"
+"\tTime the applets on made-up files, and print a line of name=value\n"
+"\tpairs for each benchmark. The files are made in a new directory\n"
+"\twithin the given one, /dev/shm by default. The benchmarks are\n"
+"\tcp, cp-links, rm, chmod, ls, find, star, tarcat, ctar, gzip, zcat, dd\n"
+"\tand dutmp.\n"
+"\n"
+"\t-n:\tMake a tree of this many files. The default is 1000.\n"
+"\t-s:\tMake each file this many bytes long. The default is 4k.\n"
+"\t-b:\tMake the data file for gzip, zcat and dd this many bytes\n"
+"\t\tlong. The default is 16M.\n"
+"\t-r:\tTime each benchmark this many times, and report the fastest.\n"
+"\t\tThe default is 3.\n";
+
+/*
+ * Each benchmark runs its command as a separate process, exec()ing this
+ * binary under the applet's name. It is timed without interference and
+ * its peak RSS taken from wait4(), then run once more under ptrace() to
+ * count its system calls. The prepare and cleanup commands run untimed,
+ * before and after every run, to put the files back as they were.
+ */
+
+#define	FILES_PER_DIRECTORY	100
+#define	MAXIMUM_ARGUMENTS	16
+#define	BUFFER_SIZE			(64 * 1024)
+
+enum Unit {
+	TreeFiles,				/* Every file in the tree */
+	DirectoryFiles,			/* The files in one directory of the tree */
+	DataBytes,				/* The data file */
+	UtmpRecords
+};
+
+struct Benchmark {
+	const char *	name;
+	const char *	command;	/* Split at spaces */
+	const char *	input;		/* Standard input, or 0 */
+	const char *	output;		/* Standard output, or 0 for /dev/null */
+	const char *	prepare;
+	const char *	cleanup;
+	enum Unit		unit;
+};
+
+static const struct Benchmark	benchmarks[] = {
+{ "cp",		"cp -r tree copy",		0, 0, 0, "rm -r copy",	TreeFiles },
+{ "cp-links",	"cp -a -j 8 links copy",	0, 0, 0, "rm -r copy",
+																TreeFiles },
+{ "rm",		"rm -r copy",			0, 0, "cp -r tree copy", 0,	TreeFiles },
+{ "chmod",	"chmod -R 700 copy",	0, 0, "cp -r tree copy", "rm -r copy",
+																TreeFiles },
+{ "ls",		"ls -l tree/0",			0, 0, 0, 0,				DirectoryFiles },
+{ "find",	"find tree",			0, 0, 0, 0,				TreeFiles },
+{ "star",	"star",					"archive.tar", 0, 0, "rm -r archive",
+																TreeFiles },
+{ "tarcat",	"tarcat archive/0/0",	"archive.tar", 0, 0, 0,	TreeFiles },
+{ "ctar",	"ctar tree",			0, "tree.tar", 0, 0,	TreeFiles },
+{ "gzip",	"gzip",					"data", "data.gz.out", 0, 0,	DataBytes },
+{ "zcat",	"zcat",					"data.gz", 0, 0, 0,		DataBytes },
+{ "dd",		"dd bs=64k",			"data", "data.out", 0, 0,	DataBytes },
+{ "dutmp",	"dutmp utmp",			0, 0, 0, 0,				UtmpRecords },
+{ 0 }
+};
+
+struct Result {
+	int		status;
+	double	seconds;
+	long	maximumRSS;			/* Kilobytes */
+	long	syscalls;
+};
+
+static char	self[PATH_MAX];
+static long	files = 1000;
+static long	fileSize = 4096;
+static long	dataSize = 16 * 1024 * 1024;
+
+static long
+parse_size(const char * s)
+{
+	char *	end;
+	long	n = strtol(s, &end, 10);
+
+	switch ( *end ) {
+	case 'k':
+	case 'K':
+		return n * 1024;
+	case 'm':
+	case 'M':
+		return n * 1024 * 1024;
+	case 'g':
+	case 'G':
+		return n * 1024 * 1024 * 1024;
+	}
+	return n;
+}
+
+/*
+ * Fill the buffer with text that gzip can do something with. The same
+ * seed always gives the same text.
+ */
+static void
+fill(char * buffer, long length, unsigned long seed)
+{
+	static const char * const	words[] = {
+		"the ", "quick ", "brown ", "fox ", "jumps ", "over ", "lazy ",
+		"dog ", "busybox ", "kernel ", "file ", "tree ", "\n"
+	};
+	long	n = 0;
+
+	while ( n < length ) {
+		const char *	w;
+		int				l;
+
+		seed = seed * 1103515245 + 12345;
+		w = words[(seed >> 16) % (sizeof(words) / sizeof(words[0]))];
+		l = strlen(w);
+		if ( l > length - n )
+			l = length - n;
+		memcpy(&buffer[n], w, l);
+		n += l;
+	}
+}
+
+static int
+write_fully(int fd, const char * buffer, long length)
+{
+	while ( length > 0 ) {
+		long	n = write(fd, buffer, length);
+
+		if ( n < 0 && errno == EINTR )
+			continue;
+		if ( n <= 0 )
+			return -1;
+		buffer += n;
+		length -= n;
+	}
+	return 0;
+}
+
+static int
+make_file(const char * name, long size, unsigned long seed)
+{
+	char	buffer[BUFFER_SIZE];
+	int		fd;
+
+	if ( (fd = open(name, O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0 ) {
+		name_and_error(name);
+		return -1;
+	}
+	while ( size > 0 ) {
+		long	n = size < BUFFER_SIZE ? size : BUFFER_SIZE;
+
+		fill(buffer, n, seed++);
+		if ( write_fully(fd, buffer, n) != 0 ) {
+			name_and_error(name);
+			close(fd);
+			return -1;
+		}
+		size -= n;
+	}
+	return close(fd);
+}
+
+static int
+make_tree(void)
+{
+	char	name[64];
+	long	n;
+
+	if ( mkdir("tree", 0755) != 0 ) {
+		name_and_error("tree");
+		return -1;
+	}
+	for ( n = 0; n < files; n++ ) {
+		if ( n % FILES_PER_DIRECTORY == 0 ) {
+			sprintf(name, "tree/%ld", n / FILES_PER_DIRECTORY);
+			if ( mkdir(name, 0755) != 0 ) {
+				name_and_error(name);
+				return -1;
+			}
+		}
+		sprintf(name, "tree/%ld/%ld"
+		 ,n / FILES_PER_DIRECTORY, n % FILES_PER_DIRECTORY);
+		if ( make_file(name, fileSize, n) != 0 )
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * Two more trees, "links/a" and "links/b", of hard links to the files in
+ * "tree". Copying both with cp -a makes every file once and links to it
+ * once, with the threads racing between the two.
+ */
+static int
+make_links(void)
+{
+	static const char * const	trees[] = { "links", "links/a", "links/b" };
+	char	name[64];
+	char	linkName[64];
+	long	n;
+	int		t;
+
+	for ( t = 0; t < 3; t++ ) {
+		if ( mkdir(trees[t], 0755) != 0 ) {
+			name_and_error(trees[t]);
+			return -1;
+		}
+	}
+	for ( n = 0; n < files; n++ ) {
+		sprintf(name, "tree/%ld/%ld"
+		 ,n / FILES_PER_DIRECTORY, n % FILES_PER_DIRECTORY);
+		for ( t = 1; t < 3; t++ ) {
+			if ( n % FILES_PER_DIRECTORY == 0 ) {
+				sprintf(linkName, "%s/%ld", trees[t], n / FILES_PER_DIRECTORY);
+				if ( mkdir(linkName, 0755) != 0 ) {
+					name_and_error(linkName);
+					return -1;
+				}
+			}
+			sprintf(linkName, "%s/%ld/%ld", trees[t]
+			 ,n / FILES_PER_DIRECTORY, n % FILES_PER_DIRECTORY);
+			if ( link(name, linkName) != 0 ) {
+				name_and_error(linkName);
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+static int
+tar_header(
+ int			fd
+,const char *	name
+,mode_t			mode
+,long			size
+,TarFileType	type)
+{
+	char	h[512];
+	TarInfo	d;
+
+	memset(&d, 0, sizeof(d));
+	d.Name = (char *)name;
+	d.Mode = mode;
+	d.UserID = getuid();
+	d.GroupID = getgid();
+	d.Size = size;
+	d.ModTime = time(0);
+	d.Type = type;
+	EncodeTarHeader(h, &d);
+	return write_fully(fd, h, sizeof(h));
+}
+
+/*
+ * A ustar archive of the same files as the tree, under "archive/".
+ */
+static int
+make_archive(void)
+{
+	char *	buffer = malloc(fileSize + 512);
+	char	name[64];
+	int		fd;
+	long	n;
+
+	if ( buffer == 0
+	 || (fd = open("archive.tar", O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0 ) {
+		name_and_error("archive.tar");
+		return -1;
+	}
+	if ( tar_header(fd, "archive/", 0755, 0, Directory) != 0 )
+		goto error;
+	for ( n = 0; n < files; n++ ) {
+		long	padded = (fileSize + 511) & ~511L;
+
+		if ( n % FILES_PER_DIRECTORY == 0 ) {
+			sprintf(name, "archive/%ld/", n / FILES_PER_DIRECTORY);
+			if ( tar_header(fd, name, 0755, 0, Directory) != 0 )
+				goto error;
+		}
+		sprintf(name, "archive/%ld/%ld"
+		 ,n / FILES_PER_DIRECTORY, n % FILES_PER_DIRECTORY);
+		if ( tar_header(fd, name, 0644, fileSize, NormalFile1) != 0 )
+			goto error;
+		memset(buffer, 0, padded);
+		fill(buffer, fileSize, n);
+		if ( write_fully(fd, buffer, padded) != 0 )
+			goto error;
+	}
+	memset(buffer, 0, 512);
+	if ( write_fully(fd, buffer, 512) != 0 || write_fully(fd, buffer, 512) != 0 )
+		goto error;
+	free(buffer);
+	return close(fd);
+
+error:
+	name_and_error("archive.tar");
+	free(buffer);
+	close(fd);
+	return -1;
+}
+
+static int
+make_utmp(void)
+{
+	struct utmp	u;
+	int			fd;
+	long		n;
+
+	if ( (fd = open("utmp", O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0 ) {
+		name_and_error("utmp");
+		return -1;
+	}
+	for ( n = 0; n < files; n++ ) {
+		memset(&u, 0, sizeof(u));
+		u.ut_type = USER_PROCESS;
+		u.ut_pid = 1000 + n;
+		sprintf(u.ut_line, "pts/%ld", n % 1000);
+		sprintf(u.ut_id, "%ld", n % 10000);
+		sprintf(u.ut_user, "user%ld", n % 1000);
+		sprintf(u.ut_host, "host%ld.example.com", n);
+		u.ut_tv.tv_sec = time(0);
+		if ( write_fully(fd, (char *)&u, sizeof(u)) != 0 ) {
+			name_and_error("utmp");
+			close(fd);
+			return -1;
+		}
+	}
+	return close(fd);
+}
+
+static double
+now(void)
+{
+	struct timespec	t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/*
+ * Count the system calls made by "pid", and any threads it starts, until
+ * it exits. Every call stops the tracee twice, on the way in and out.
+ */
+static long
+count_syscalls(pid_t pid, int * status)
+{
+	long	stops = 0;
+	pid_t	t;
+	int		s;
+
+	if ( waitpid(pid, &s, 0) != pid || !WIFSTOPPED(s) )
+		return -1;
+	ptrace(PTRACE_SETOPTIONS, pid, 0
+	 ,PTRACE_O_TRACESYSGOOD|PTRACE_O_TRACECLONE|PTRACE_O_EXITKILL);
+	ptrace(PTRACE_SYSCALL, pid, 0, 0);
+
+	while ( (t = waitpid(-1, &s, __WALL)) > 0 ) {
+		int	forwarded = 0;
+
+		if ( WIFEXITED(s) || WIFSIGNALED(s) ) {
+			if ( t == pid )
+				*status = s;
+			continue;
+		}
+		if ( WSTOPSIG(s) == (SIGTRAP|0x80) )
+			stops++;
+		else if ( WSTOPSIG(s) != SIGTRAP && WSTOPSIG(s) != SIGSTOP )
+			forwarded = WSTOPSIG(s);
+		ptrace(PTRACE_SYSCALL, t, 0, forwarded);
+	}
+	return (stops + 1) / 2;
+}
+
+/*
+ * Run "command" in the current directory, with its standard input and
+ * output redirected, and fill in the result.
+ */
+static int
+run(
+ const char *		command
+,const char *		input
+,const char *		output
+,int				trace
+,struct Result *	r)
+{
+	char			buffer[256];
+	char *			argv[MAXIMUM_ARGUMENTS + 1];
+	struct rusage	usage;
+	double			start;
+	pid_t			pid;
+	int				argc = 0;
+	int				status = 0;
+	char *			s;
+
+	strncpy(buffer, command, sizeof(buffer) - 1);
+	buffer[sizeof(buffer) - 1] = '\0';
+	for ( s = strtok(buffer, " "); s && argc < MAXIMUM_ARGUMENTS; s = strtok(0, " ") )
+		argv[argc++] = s;
+	argv[argc] = 0;
+
+	fflush(0);
+	start = now();
+	if ( (pid = fork()) < 0 ) {
+		name_and_error("fork");
+		return -1;
+	}
+	if ( pid == 0 ) {
+		int	in = open(input ? input : "/dev/null", O_RDONLY);
+		int	out = open(output ? output : "/dev/null"
+			 ,O_WRONLY|O_CREAT|O_TRUNC, 0644);
+
+		if ( in < 0 || out < 0 )
+			_exit(126);
+		dup2(in, 0);
+		dup2(out, 1);
+		close(in);
+		close(out);
+		if ( trace ) {
+			ptrace(PTRACE_TRACEME, 0, 0, 0);
+			raise(SIGSTOP);
+		}
+		execv(self, argv);
+		_exit(127);
+	}
+
+	memset(r, 0, sizeof(*r));
+	if ( trace )
+		r->syscalls = count_syscalls(pid, &status);
+	else if ( wait4(pid, &status, 0, &usage) == pid )
+		r->maximumRSS = usage.ru_maxrss;
+	r->seconds = now() - start;
+
+	if ( WIFEXITED(status) )
+		r->status = WEXITSTATUS(status);
+	else
+		r->status = 128 + WTERMSIG(status);
+	return r->status;
+}
+
+static void
+benchmark(const struct Benchmark * b, int runs)
+{
+	struct Result	best;
+	struct Result	r;
+	struct Result	ignored;
+	double			items;
+	double			bytes;
+	int				n;
+
+	memset(&best, 0, sizeof(best));
+	for ( n = 0; n <= runs; n++ ) {
+		int	trace = (n == runs);
+
+		if ( b->prepare )
+			run(b->prepare, 0, 0, 0, &ignored);
+		run(b->command, b->input, b->output, trace, &r);
+		if ( b->cleanup )
+			run(b->cleanup, 0, 0, 0, &ignored);
+
+		if ( r.status != 0 )
+			best.status = r.status;
+		if ( trace )
+			best.syscalls = r.syscalls;
+		else {
+			if ( n == 0 || r.seconds < best.seconds )
+				best.seconds = r.seconds;
+			if ( r.maximumRSS > best.maximumRSS )
+				best.maximumRSS = r.maximumRSS;
+		}
+	}
+
+	switch ( b->unit ) {
+	case TreeFiles:
+		items = files;
+		bytes = (double)files * fileSize;
+		break;
+	case DirectoryFiles:
+		items = files < FILES_PER_DIRECTORY ? files : FILES_PER_DIRECTORY;
+		bytes = items * fileSize;
+		break;
+	case DataBytes:
+		items = 1;
+		bytes = dataSize;
+		break;
+	default:
+		items = files;
+		bytes = (double)files * sizeof(struct utmp);
+		break;
+	}
+	if ( best.seconds <= 0 )
+		best.seconds = 1e-9;
+
+	printf("benchmark=%s status=%d items=%.0f bytes=%.0f seconds=%.6f"
+	 " items_per_second=%.0f bytes_per_second=%.0f syscalls=%ld"
+	 " syscalls_per_item=%.1f max_rss_kb=%ld\n"
+	 ,b->name
+	 ,best.status
+	 ,items
+	 ,bytes
+	 ,best.seconds
+	 ,items / best.seconds
+	 ,bytes / best.seconds
+	 ,best.syscalls
+	 ,best.syscalls / items
+	 ,best.maximumRSS);
+	fflush(stdout);
+}
+
+static int
+selected(const struct Benchmark * b, int argc, char * * argv)
+{
+	int	n;
+
+	if ( argc <= 1 )
+		return 1;
+	for ( n = 1; n < argc; n++ )
+		if ( strcmp(argv[n], b->name) == 0 )
+			return 1;
+	return 0;
+}
+
+static int
+applet_present(const char * command)
+{
+	char	name[32];
+	int		n = strcspn(command, " ");
+
+	if ( n >= (int)sizeof(name) )
+		return 0;
+	memcpy(name, command, n);
+	name[n] = '\0';
+	return find_applet(name) != 0;
+}
+
+extern int
+bbbench_main(struct FileInfo * i, int argc, char * * argv)
+{
+	const char *			parent = "/dev/shm";
+	const struct Benchmark *	b;
+	char					directory[PATH_MAX];
+	char					command[PATH_MAX];
+	struct Result			r;
+	int						runs = 3;
+	int						n;
+
+	while ( argc > 1 && argv[1][0] == '-' ) {
+		if ( argc < 3 || argv[1][2] != '\0' ) {
+			usage(bbbench_usage);
+			return 1;
+		}
+		switch ( argv[1][1] ) {
+		case 'd':
+			parent = argv[2];
+			break;
+		case 'n':
+			files = parse_size(argv[2]);
+			break;
+		case 's':
+			fileSize = parse_size(argv[2]);
+			break;
+		case 'b':
+			dataSize = parse_size(argv[2]);
+			break;
+		case 'r':
+			runs = atoi(argv[2]);
+			break;
+		default:
+			usage(bbbench_usage);
+			return 1;
+		}
+		argc -= 2;
+		argv += 2;
+	}
+	if ( files < 1 || fileSize < 0 || dataSize < 0 || runs < 1 ) {
+		usage(bbbench_usage);
+		return 1;
+	}
+	for ( n = 1; n < argc; n++ ) {
+		for ( b = benchmarks; b->name; b++ )
+			if ( strcmp(argv[n], b->name) == 0 )
+				break;
+		if ( b->name == 0 ) {
+			fprintf(stderr, "%s: no such benchmark.\n", argv[n]);
+			return 1;
+		}
+	}
+
+	if ( (n = readlink("/proc/self/exe", self, sizeof(self) - 1)) < 0 ) {
+		name_and_error("/proc/self/exe");
+		return 1;
+	}
+	self[n] = '\0';
+
+	if ( !is_a_directory(parent) )
+		parent = "/tmp";
+	sprintf(directory, "%s/bbbench.%d", parent, (int)getpid());
+	if ( mkdir(directory, 0755) != 0 || chdir(directory) != 0 ) {
+		name_and_error(directory);
+		return 1;
+	}
+
+	printf("directory=%s files=%ld file_size=%ld data_size=%ld runs=%d\n"
+	 ,directory, files, fileSize, dataSize, runs);
+	fflush(stdout);
+
+	if ( make_tree() != 0
+	 || make_links() != 0
+	 || make_archive() != 0
+	 || make_file("data", dataSize, 0) != 0
+	 || make_utmp() != 0 )
+		return 1;
+	if ( find_applet("gzip") != 0 )
+		run("gzip", "data", "data.gz", 0, &r);
+
+	for ( b = benchmarks; b->name; b++ ) {
+		if ( !selected(b, argc, argv) )
+			continue;
+		if ( !applet_present(b->command)
+		 || (b->prepare && !applet_present(b->prepare))
+		 || (b->cleanup && !applet_present(b->cleanup))
+		 || (b->input && access(b->input, R_OK) != 0) ) {
+			printf("benchmark=%s status=missing\n", b->name);
+			continue;
+		}
+		benchmark(b, runs);
+	}
+
+	sprintf(command, "rm -r %s", strrchr(directory, '/') + 1);
+	if ( chdir(parent) == 0 && find_applet("rm") != 0 )
+		run(command, 0, 0, 0, &r);
+	return 0;
+}
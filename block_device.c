@@ -2,6 +2,7 @@
 #include <dirent.h>
 #include <string.h>
 #include <stdio.h>
+#include <fcntl.h>
 
 const char	block_device_usage[] = "block_device mount-point";
 
@@ -30,6 +31,7 @@ block_device_main(struct FileInfo * i, int argc, char * * argv)
 
 char * block_device(const char *name, struct FileInfo *i)
 {
+	static struct FileOptions	o;
 	struct stat	s;
         char *buf;
 	int dinam=0;
@@ -43,9 +45,12 @@ char * block_device(const char *name, struct FileInfo *i)
 	my_device=(dev_t *)malloc(sizeof(dev_t));
 	*my_device = s.st_dev;
 	my_device_name = NULL;
+	o.processDirectoriesAfterTheirContents=1;
+	i->options = &o;
 	i->source = "/dev";
+	i->directoryFd = AT_FDCWD;
+	i->name = i->source;
 	i->stat = s;
-	i->processDirectoriesAfterTheirContents=1;
 	descend(i, match_mount);
 	if (dinam) free(i);
 	if ( my_device_name ) {
@@ -3,17 +3,22 @@
  * IE	//#define BB_BLAH
  */
 
+#define BB_BATCH
+#define BB_BENCH
 //#define BB_BLOCK_DEVICE
 #define BB_CAT
 #define BB_CHGRP
 #define BB_CHMOD
 #define BB_CHOWN
 #define BB_CLEAR
+#define BB_COPY
 #define BB_CP
+#define BB_CTAR
 #define BB_DATE
 #define BB_DD
 #define BB_DESCEND
 #define BB_DF
+#define BB_DIRSTREAM
 #define BB_DMESG
 #define BB_DUTMP
 #define BB_DYADIC
@@ -22,6 +27,8 @@
 #define BB_FIND
 #define BB_FINDMOUNT
 //#define BB_HALT
+#define BB_HARDLINK
+#define BB_IDCACHE
 //#define BB_INIT
 #define BB_KILL
 //#define BB_LENGTH
@@ -41,6 +48,8 @@
 #define BB_MOUNT
 //#define BB_MT
 #define BB_MV
+#define BB_PDESCEND
+#define BB_POOL
 #define BB_POSTPROCESS
 #define BB_PWD
 //#define BB_REBOOT
@@ -54,6 +63,8 @@
 //#define BB_TARCAT
 #define BB_TARFN
 #define BB_TOUCH
+//#define BB_TRACE
+#define BB_TRANSFER
 #define BB_TRUE
 #define BB_UMOUNT
 #define BB_UPDATE
@@ -1,34 +1,42 @@
 #include "internal.h"
 #include <stdio.h>
+#include <fcntl.h>
 
 const char	cat_usage[] = "cat [file ...]";
 
+/*
+ * The data goes straight from one descriptor to the other by whatever
+ * means copy_data() finds: splice() to a pipe, sendfile() or
+ * copy_file_range() from a regular file, or a large buffer.
+ */
 extern int
 cat_fn(const struct FileInfo * i)
 {
-	FILE *	f = stdin;
-	int		c;
+	int		fd = 0;
+	int		status = 0;
 
 	if ( i ) {
-		f = fopen(i->source, "r");
-		if ( f == NULL ) {
+		fd = openat(i->directoryFd, i->name, O_RDONLY);
+		if ( fd < 0 ) {
 			name_and_error(i->source);
 			return 1;
 		}
 	}
-	while ( (c = getc(f)) != EOF )
-		putc(c, stdout);
-	if ( i )
-		fclose(f);
 	fflush(stdout);
-	return 0;
+	if ( copy_data(fd, 1, -1) < 0 ) {
+		name_and_error(i ? i->source : "stdin");
+		status = 1;
+	}
+	if ( i )
+		close(fd);
+	return status;
 }
 
 extern int
 cat_more_main(struct FileInfo * i, int argc, char * * argv)
 {
 	if ( argc == 1 )
-		return (i->applet->function)(0);
+		return (i->options->applet->function)(0);
 	else
 		return monadic_main(i, argc, argv);
 }
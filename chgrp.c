@@ -2,20 +2,31 @@
 #include <grp.h>
 #include <stdio.h>
 
-const char	chgrp_usage[] = "chgrp [-R] group-name file [file ...]\n"
+const char	chgrp_usage[] = "chgrp [-R] [-j threads] group-name file [file ...]\n"
 "\n\tThe group list is kept in the file /etc/groups.\n\n"
 "\t-R:\tRecursively change the group of all files and directories\n"
-"\t\tunder the argument directory.";
+"\t\tunder the argument directory.\n"
+"\t-j:\tUse this many threads to walk the directory tree.";
 
 extern int
 chgrp_main(struct FileInfo * i, int argc, char * * argv)
 {
+	struct FileOptions *	o = i->options;
 	struct group *	g;
 
-	while ( argc >= 3 && strcmp("-R", argv[1]) == 0 ) {
-		i->recursive = 1;
-		argc--;
-		argv++;
+	while ( argc >= 3 && argv[1][0] == '-' ) {
+		if ( strcmp("-R", argv[1]) == 0 ) {
+			o->recursive = 1;
+			argc--;
+			argv++;
+		}
+		else if ( strcmp("-j", argv[1]) == 0 && argc >= 4 ) {
+			o->threads = atoi(argv[2]);
+			argc -= 2;
+			argv += 2;
+		}
+		else
+			break;
 	}
 
 	if ( (g = getgrnam(argv[1])) == 0 ) {
@@ -26,9 +37,10 @@ chgrp_main(struct FileInfo * i, int argc, char * * argv)
 	argv++;
 	argc--;
 
-	i->groupID = g->gr_gid;
-	i->changeGroupID = 1;
-	i->complainInPostProcess = 1;
+	o->groupID = g->gr_gid;
+	o->changeGroupID = 1;
+	o->complainInPostProcess = 1;
+	o->unsorted = 1;
 
 	return monadic_main(i, argc, argv);
 }
@@ -4,7 +4,7 @@
 #include <sys/stat.h>
 #include "internal.h"
 
-const char	chmod_usage[] = "chmod [-R] mode file [file ...]\n"
+const char	chmod_usage[] = "chmod [-R] [-j threads] mode file [file ...]\n"
 "\nmode may be an octal integer representing the bit pattern for the\n"
 "\tnew mode, or a symbolic value matching the pattern\n"
 "\t[ugoa]{+|-|=}[rwxst] .\n"
@@ -26,7 +26,8 @@ const char	chmod_usage[] = "chmod [-R] mode file [file ...]\n"
 "\tModes may be concatenated, as in \"u=rwx,g=rx,o=rx,-t,-s\n"
 "\n"
 "\t-R:\tRecursively change the mode of all files and directories\n"
-"\t\tunder the argument directory.";
+"\t\tunder the argument directory.\n"
+"\t-j:\tUse this many threads to walk the directory tree.";
 
 int
 parse_mode(
@@ -138,26 +139,34 @@ parse_mode(
 extern int
 chmod_main(struct FileInfo * i, int argc, char * * argv)
 {
-	i->andWithMode = S_ISVTX|S_ISUID|S_ISGID|S_IRWXU|S_IRWXG|S_IRWXO;
-	i->orWithMode = 0;
+	struct FileOptions *	o = i->options;
+
+	o->andWithMode = S_ISVTX|S_ISUID|S_ISGID|S_IRWXU|S_IRWXG|S_IRWXO;
+	o->orWithMode = 0;
 
 	while ( argc >= 3 ) {
-		if ( parse_mode(argv[1], &i->orWithMode, &i->andWithMode, 0)
+		if ( parse_mode(argv[1], &o->orWithMode, &o->andWithMode, 0)
 		 == 0 ) {
 			argc--;
 			argv++;
 		}
 		else if ( strcmp(argv[1], "-R") == 0 ) {
-			i->recursive = 1;
+			o->recursive = 1;
 			argc--;
 			argv++;
 		}
+		else if ( strcmp(argv[1], "-j") == 0 && argc >= 4 ) {
+			o->threads = atoi(argv[2]);
+			argc -= 2;
+			argv += 2;
+		}
 		else
 			break;
 	}
 
-	i->changeMode = 1;
-	i->complainInPostProcess = 1;
+	o->changeMode = 1;
+	o->complainInPostProcess = 1;
+	o->unsorted = 1;
 
 	return monadic_main(i, argc, argv);
 }
@@ -1,18 +1,16 @@
 #include "internal.h"
-#include <pwd.h>
-#include <grp.h>
 #include <string.h>
 #include <stdio.h>
 
-const char	chown_usage[] = "chown [-R] user-name file [file ...]\n"
+const char	chown_usage[] = "chown [-R] [-j threads] user-name file [file ...]\n"
 "\n\tThe group list is kept in the file /etc/groups.\n\n"
 "\t-R:\tRecursively change the mode of all files and directories\n"
-"\t\tunder the argument directory.";
+"\t\tunder the argument directory.\n"
+"\t-j:\tUse this many threads to walk the directory tree.";
 
 int
-parse_user_name(const char * s, struct FileInfo * i)
+parse_user_name(const char * s, struct FileOptions * o)
 {
-	struct	passwd * 	p;
 	char *				dot = strchr(s, '.');
 
 	if (! dot )
@@ -21,20 +19,17 @@ parse_user_name(const char * s, struct FileInfo * i)
 	if ( dot )
 		*dot = '\0';
 
-	if ( (p = getpwnam(s)) == 0 ) {
+	if ( user_id(s, &o->userID) != 0 ) {
 		fprintf(stderr, "%s: no such user.\n", s);
 		return 1;
 	}
-	i->userID = p->pw_uid;
 
 	if ( dot ) {
-		struct group *	g = getgrnam(++dot);
-		if ( g == 0 ) {
+		if ( group_id(++dot, &o->groupID) != 0 ) {
 			fprintf(stderr, "%s: no such group.\n", dot);
 			return 1;
 		}
-		i->groupID = g->gr_gid;
-		i->changeGroupID = 1;
+		o->changeGroupID = 1;
 	}
 	return 0;
 }
@@ -42,22 +37,33 @@ parse_user_name(const char * s, struct FileInfo * i)
 extern int
 chown_main(struct FileInfo * i, int argc, char * * argv)
 {
+	struct FileOptions *	o = i->options;
 	int					status;
 
-	while ( argc >= 3 && strcmp("-R", argv[1]) == 0 ) {
-		i->recursive = 1;
-		argc--;
-		argv++;
+	while ( argc >= 3 && argv[1][0] == '-' ) {
+		if ( strcmp("-R", argv[1]) == 0 ) {
+			o->recursive = 1;
+			argc--;
+			argv++;
+		}
+		else if ( strcmp("-j", argv[1]) == 0 && argc >= 4 ) {
+			o->threads = atoi(argv[2]);
+			argc -= 2;
+			argv += 2;
+		}
+		else
+			break;
 	}
 
-	if ( (status = parse_user_name(argv[1], i)) != 0 )
+	if ( (status = parse_user_name(argv[1], o)) != 0 )
 		return status;
 
 	argv++;
 	argc--;
 
-	i->changeUserID = 1;
-	i->complainInPostProcess = 1;
+	o->changeUserID = 1;
+	o->complainInPostProcess = 1;
+	o->unsorted = 1;
 
 	return monadic_main(i, argc, argv);
 }
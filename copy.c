@@ -0,0 +1,421 @@
+#include "internal.h"
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+
+/*
+ * Move file data without bringing it through user space where we can
+ * help it. Each method is tried in turn and the next one takes over,
+ * from wherever the file offsets have got to, when the kernel won't do
+ * it: copy_file_range() between regular files, then sendfile() from a
+ * regular file to anything, then splice() to or from a pipe. The last
+ * resort is read() and write() through a large aligned buffer, which
+ * also finishes any copy, in case a file claimed to be empty to the
+ * others, as some in /proc do.
+ *
+ * Sparse copies find the source's holes with SEEK_DATA and SEEK_HOLE, and
+ * seek over them in the destination rather than writing zeros. Where the
+ * file system can't say, or for --sparse=always, the data is scanned for
+ * blocks of zeros instead. The destination is extended with ftruncate()
+ * if it ends in a hole.
+ */
+
+#define	COPY_BUFFER_SIZE	(1024 * 1024)
+#define	SEEK_MINIMUM		(16 * 1024)	/* Shorter skips are cheaper to read */
+#define	COPY_CHUNK			(1024 * 1024 * 1024)
+#define	SPARSE_BLOCK		4096
+
+static __thread char *	buffer = 0;
+
+static int
+is_regular(int fd)
+{
+	struct stat	s;
+
+	return ( fstat(fd, &s) == 0 && S_ISREG(s.st_mode) );
+}
+
+static int
+is_pipe(int fd)
+{
+	struct stat	s;
+
+	return ( fstat(fd, &s) == 0 && S_ISFIFO(s.st_mode) );
+}
+
+/*
+ * Errors that mean "not with this method", rather than an I/O error.
+ */
+static int
+unsupported(int error)
+{
+	return ( error == EINVAL
+	 || error == ENOSYS
+	 || error == EXDEV
+	 || error == EOPNOTSUPP
+	 || error == EBADF );
+}
+
+static long
+chunk(long long length, long long copied, long size)
+{
+	if ( length < 0 || length - copied > size )
+		return size;
+	return length - copied;
+}
+
+extern char *
+copy_buffer(void)
+{
+	if ( buffer == 0 && posix_memalign((void * *)&buffer, 4096, COPY_BUFFER_SIZE) != 0 )
+		buffer = 0;
+	return buffer;
+}
+
+/*
+ * Copy "length" bytes, or everything up to the end of the input when it
+ * is negative, from "in" to "out" at their current offsets. Returns the
+ * number of bytes copied, which is short only at the end of the input,
+ * or -1 with errno set.
+ */
+extern long long
+copy_data(int in, int out, long long length)
+{
+	long long	copied = 0;
+	int			regular = is_regular(in);
+	long		n = 0;
+
+	if ( regular && is_regular(out) ) {
+		while ( length < 0 || copied < length ) {
+			n = copy_file_range(in, 0, out, 0, chunk(length, copied, COPY_CHUNK), 0);
+			if ( n <= 0 )
+				break;
+			copied += n;
+		}
+		if ( n < 0 && !unsupported(errno) )
+			return -1;
+	}
+
+	if ( regular ) {
+		while ( length < 0 || copied < length ) {
+			n = sendfile(out, in, 0, chunk(length, copied, COPY_CHUNK));
+			if ( n <= 0 )
+				break;
+			copied += n;
+		}
+		if ( n < 0 && !unsupported(errno) )
+			return -1;
+	}
+	else if ( is_pipe(in) || is_pipe(out) ) {
+		while ( length < 0 || copied < length ) {
+			n = splice(in, 0, out, 0, chunk(length, copied, COPY_CHUNK)
+			 ,SPLICE_F_MOVE|SPLICE_F_MORE);
+			if ( n <= 0 )
+				break;
+			copied += n;
+		}
+		if ( n < 0 && !unsupported(errno) )
+			return -1;
+		if ( n == 0 )
+			return copied;	/* The end of a pipe is the end */
+	}
+
+	if ( copy_buffer() == 0 )
+		return -1;
+	while ( length < 0 || copied < length ) {
+		long	done = 0;
+
+		n = read(in, buffer, chunk(length, copied, COPY_BUFFER_SIZE));
+		if ( n < 0 && errno == EINTR )
+			continue;
+		if ( n <= 0 )
+			return n < 0 ? -1 : copied;
+		while ( done < n ) {
+			long	w = write(out, &buffer[done], n - done);
+
+			if ( w < 0 && errno == EINTR )
+				continue;
+			if ( w <= 0 )
+				return -1;
+			done += w;
+		}
+		copied += n;
+	}
+	return copied;
+}
+
+static int
+is_zero(const char * b, long length)
+{
+	return ( length == 0 || (b[0] == 0 && memcmp(b, &b[1], length - 1) == 0) );
+}
+
+/*
+ * Write "length" bytes to a regular file, seeking over each block of zeros
+ * instead of writing it. With an "offset" of -1 the file's own offset is
+ * used and moved on; otherwise the data goes there, as with pwrite().
+ * Returns "length", or -1 with errno set.
+ */
+static long
+write_blocks(int fd, const char * b, long length, long long offset)
+{
+	long	done = 0;
+
+	while ( done < length ) {
+		long	n = 0;
+		long	w;
+
+		while ( done + n < length ) {
+			long	block = chunk(length, done + n, SPARSE_BLOCK);
+
+			if ( !is_zero(&b[done + n], block) )
+				break;
+			n += block;
+		}
+		if ( n > 0 ) {
+			if ( offset < 0 && lseek(fd, n, SEEK_CUR) < 0 )
+				return -1;
+			done += n;
+			continue;
+		}
+		while ( done + n < length ) {
+			long	block = chunk(length, done + n, SPARSE_BLOCK);
+
+			if ( is_zero(&b[done + n], block) )
+				break;
+			n += block;
+		}
+		while ( n > 0 ) {
+			if ( offset < 0 )
+				w = write(fd, &b[done], n);
+			else
+				w = pwrite(fd, &b[done], n, offset + done);
+			if ( w < 0 && errno == EINTR )
+				continue;
+			if ( w <= 0 )
+				return -1;
+			done += w;
+			n -= w;
+		}
+	}
+	return length;
+}
+
+extern long
+write_sparse(int fd, const char * b, long length)
+{
+	return write_blocks(fd, b, length, -1);
+}
+
+extern long
+pwrite_sparse(int fd, const char * b, long length, long long offset)
+{
+	return write_blocks(fd, b, length, offset);
+}
+
+/*
+ * After write_sparse(), make the file as long as the offset it has got to,
+ * in case it ended with a hole. The file is never made shorter.
+ */
+extern int
+finish_sparse(int fd)
+{
+	struct stat	s;
+	off_t		offset = lseek(fd, 0, SEEK_CUR);
+
+	if ( offset < 0 || fstat(fd, &s) != 0 )
+		return -1;
+	if ( s.st_size < offset )
+		return ftruncate(fd, offset);
+	return 0;
+}
+
+/*
+ * Return where the next data at or after "offset" starts, and set "hole" to
+ * where it ends. If there is none, the end of the file is returned. If the
+ * file system can't tell data from holes, -1 is returned.
+ */
+extern long long
+find_data(int fd, long long offset, long long * hole)
+{
+	long long	data = lseek(fd, offset, SEEK_DATA);
+	struct stat	s;
+
+	if ( data < 0 ) {
+		if ( errno != ENXIO || fstat(fd, &s) != 0 )
+			return -1;
+		*hole = s.st_size;
+		return s.st_size > offset ? s.st_size : offset;
+	}
+	if ( (*hole = lseek(fd, data, SEEK_HOLE)) < 0 )
+		return -1;
+	return data;
+}
+
+/* Copy like copy_data(), but through write_sparse(). */
+static long long
+scan_data(int in, int out, long long length)
+{
+	long long	copied = 0;
+
+	if ( copy_buffer() == 0 )
+		return -1;
+	while ( length < 0 || copied < length ) {
+		long	n = read(in, buffer, chunk(length, copied, COPY_BUFFER_SIZE));
+
+		if ( n < 0 && errno == EINTR )
+			continue;
+		if ( n <= 0 )
+			return n < 0 ? -1 : copied;
+		if ( write_sparse(out, buffer, n) < 0 )
+			return -1;
+		copied += n;
+	}
+	return copied;
+}
+
+/*
+ * Copy as copy_data() does, leaving holes in the destination according to
+ * "sparse". The destination has to be a regular file for that; otherwise,
+ * or for SparseNever, this is just copy_data().
+ */
+extern long long
+copy_sparse(int in, int out, long long length, enum SparseMode sparse)
+{
+	struct stat	s;
+	long long	start;
+	long long	end;
+	long long	offset;
+	long long	copied;
+	long long	n;
+	int			scan = ( sparse == SparseAlways );
+
+	if ( sparse == SparseNever || !is_regular(out) || fstat(in, &s) != 0 )
+		return copy_data(in, out, length);
+
+	if ( !S_ISREG(s.st_mode) ) {
+		if ( !scan )
+			return copy_data(in, out, length);
+		if ( (n = scan_data(in, out, length)) >= 0 && finish_sparse(out) != 0 )
+			return -1;
+		return n;
+	}
+
+	/*
+	 * A file with as many blocks as its size needs has no holes to find.
+	 */
+	if ( !scan && (long long)s.st_blocks * 512 >= s.st_size )
+		return copy_data(in, out, length);
+
+	if ( (start = lseek(in, 0, SEEK_CUR)) < 0
+	 || (offset = lseek(out, 0, SEEK_CUR)) < 0 )
+		return -1;
+	end = s.st_size;
+	if ( length >= 0 && start + length < end )
+		end = start + length;
+
+	copied = 0;
+	while ( start + copied < end ) {
+		long long	hole;
+		long long	data = find_data(in, start + copied, &hole);
+
+		if ( data < 0 ) {
+			data = start + copied;
+			hole = end;
+			scan = 1;
+		}
+		if ( data >= end )
+			break;
+		if ( hole > end )
+			hole = end;
+		if ( lseek(in, data, SEEK_SET) < 0
+		 || lseek(out, offset + data - start, SEEK_SET) < 0 )
+			return -1;
+		n = scan ? scan_data(in, out, hole - data) : copy_data(in, out, hole - data);
+		if ( n < 0 )
+			return -1;
+		if ( n < hole - data ) {
+			end = data + n;		/* The file got shorter */
+			break;
+		}
+		copied = hole - start;
+	}
+	copied = end - start;
+	if ( lseek(in, end, SEEK_SET) < 0
+	 || lseek(out, offset + copied, SEEK_SET) < 0 )
+		return -1;
+
+	/* Anything more than the size said, as for files in /proc. */
+	if ( length < 0 || copied < length ) {
+		if ( (n = scan_data(in, out, length < 0 ? -1 : length - copied)) < 0 )
+			return -1;
+		copied += n;
+	}
+	if ( finish_sparse(out) != 0 )
+		return -1;
+	return copied;
+}
+
+/*
+ * Copy all of "in" to "out", which should be empty. If the file system
+ * can share the data between them with a reflink, that's all it takes,
+ * and the holes are shared too. --sparse=always makes holes of blocks
+ * of zeros, so it has to look at the data.
+ */
+extern int
+copy_file(int in, int out, enum SparseMode sparse)
+{
+	if ( sparse != SparseAlways && ioctl(out, FICLONE, in) == 0 )
+		return 0;
+	return copy_sparse(in, out, -1, sparse) < 0 ? -1 : 0;
+}
+
+/*
+ * Parse the argument to --sparse.
+ */
+extern int
+parse_sparse(const char * s, enum SparseMode * sparse)
+{
+	if ( strcmp(s, "auto") == 0 )
+		*sparse = SparseAuto;
+	else if ( strcmp(s, "always") == 0 )
+		*sparse = SparseAlways;
+	else if ( strcmp(s, "never") == 0 )
+		*sparse = SparseNever;
+	else
+		return -1;
+	return 0;
+}
+
+/*
+ * Read and throw away "length" bytes. In a file, anything but a short
+ * skip is seeked over instead, as long as it doesn't go past the end.
+ */
+extern int
+skip_data(int fd, long long length)
+{
+	struct stat	s;
+	long long	offset;
+
+	if ( length >= SEEK_MINIMUM
+	 && fstat(fd, &s) == 0
+	 && S_ISREG(s.st_mode)
+	 && (offset = lseek(fd, 0, SEEK_CUR)) >= 0 )
+		return ( offset + length <= s.st_size
+		 && lseek(fd, length, SEEK_CUR) >= 0 ) ? 0 : -1;
+	if ( copy_buffer() == 0 )
+		return -1;
+	while ( length > 0 ) {
+		long	n = read(fd, buffer, chunk(length, 0, COPY_BUFFER_SIZE));
+
+		if ( n < 0 && errno == EINTR )
+			continue;
+		if ( n <= 0 )
+			return -1;
+		length -= n;
+	}
+	return 0;
+}
@@ -4,14 +4,656 @@
 #include <sys/fcntl.h>
 #include <sys/param.h>
 #include <errno.h>
+#include <pthread.h>
 
-const char  cp_usage[] = "cp [-r] source-file destination-file\n"
-"\t\tcp [-r] source-file [source-file ...] destination-directory\n"
+const char  cp_usage[] = "cp [-a] [-p] [-r] [-j threads] [--sparse=when] [--in-flight=bytes] [--atomic] [--fsync] source-file destination-file\n"
+"\t\tcp [-a] [-p] [-r] [-j threads] [--sparse=when] [--in-flight=bytes] [--atomic] [--fsync] source-file [source-file ...] destination-directory\n"
 "\n"
 "\tCopy the source files to the destination.\n"
 "\n"
+"\t-a:\tArchive: the same as -p -r, and copy symbolic links\n"
+"\t\tas links, and hard links as links to the first copy.\n"
+"\t-p:\tPreserve the owner, mode and times of the files.\n"
 "\t-r:\tRecursively copy all files and directories\n"
-"\t\tunder the argument directory.";
+"\t\tunder the argument directory.\n"
+"\t-j:\tUse this many threads to walk the directory tree,\n"
+"\t\tand as many more to copy the files.\n"
+"\t--sparse:\tauto (the default) to keep the holes in sparse files,\n"
+"\t\talways to also make holes of blocks of zeros, or never.\n"
+"\t--in-flight:\tWith -j, how much file data may be waiting to be\n"
+"\t\tcopied at once. It may be followed by k, m or g.\n"
+"\t--atomic:\tWrite each file under no name, or a temporary one,\n"
+"\t\tand give it its own name once it is complete.\n"
+"\t--fsync:\tWrite the files, and the directories they are in,\n"
+"\t\tto the disk before finishing.";
+
+/*
+ * With -j, the walker opens each file and its copy and hands them to a
+ * pool of threads that copy the data, so a slow disk always has work in
+ * hand. No more than "inFlight" bytes of files are queued or being
+ * copied at a time.
+ *
+ * Directories are made as they are found, with write and search
+ * permission for their owner so that they can be filled. Their own modes,
+ * and any -m, -o or -g changes, are set once everything has been copied,
+ * deepest first. So are their times for -p, since filling a directory
+ * changes them.
+ *
+ * -p sets the owner, mode and times of each file through its descriptor,
+ * in the same pass as the copy. -a also makes symbolic links, and links
+ * to the copy of any file already seen under another name in "links".
+ *
+ * --atomic writes each file as an O_TMPFILE in its directory, and links
+ * it in once it is complete, so that nobody sees half a file even if we
+ * are stopped. Where O_TMPFILE isn't supported, a temporary name in the
+ * same directory is renamed instead. --fsync flushes each file before
+ * that, and then each directory we changed once, at the end, rather than
+ * once for every file put in it.
+ */
+
+#define DEFAULT_IN_FLIGHT   (64 * 1024 * 1024)
+#define JOBS_PER_THREAD     4
+
+struct CopyJob {
+    struct FileInfo info;
+    char *          destination;
+    char *          temporary;
+    int             sourceFd;
+    int             destinationFd;
+};
+
+struct Directory {
+    char *          destination;
+    struct stat     stat;
+    int             fixMode;
+    int             depth;
+};
+
+static long long        inFlight = DEFAULT_IN_FLIGHT;
+static mode_t           creationMask = 0;
+static pthread_mutex_t  lock = PTHREAD_MUTEX_INITIALIZER;
+static struct Pool *    pool = 0;
+static int              poolTried = 0;
+static struct Directory * directories = 0;
+static int              directoryCount = 0;
+static int              directorySize = 0;
+static struct HardLinks * links = 0;
+static char * *         changed = 0;        /* Directories to fsync */
+static int              changedCount = 0;
+static int              changedSize = 0;
+static __thread char *  lastChanged = 0;
+static int              serial = 0;
+
+static long long
+parse_size(const char * s)
+{
+    char *      end;
+    long long   n = strtoll(s, &end, 10);
+
+    switch ( *end ) {
+    case 'g':
+    case 'G':
+        n *= 1024;
+    case 'm':
+    case 'M':
+        n *= 1024;
+    case 'k':
+    case 'K':
+        n *= 1024;
+        end++;
+    }
+    if ( end == s || *end != '\0' || n <= 0 )
+        return -1;
+    return n;
+}
+
+static struct Pool *
+copy_pool(const struct FileOptions * o)
+{
+    struct Pool *   p;
+
+    if ( o->threads <= 1 )
+        return 0;
+    pthread_mutex_lock(&lock);
+    if ( !poolTried ) {
+        pool = pool_create(o->threads, o->threads * JOBS_PER_THREAD, inFlight);
+        poolTried = 1;
+    }
+    p = pool;
+    pthread_mutex_unlock(&lock);
+    return p;
+}
+
+/*
+ * Only the superuser can give files away, so that isn't an error for
+ * anyone else; but then the set-ID bits, which would be somebody else's,
+ * are dropped, as chown() would.
+ */
+static int
+give_away(int result, mode_t * mode)
+{
+    if ( result == 0 )
+        return 0;
+    if ( errno != EPERM || geteuid() == 0 )
+        return -1;
+    *mode &= ~(S_ISUID|S_ISGID);
+    return 0;
+}
+
+/*
+ * Give the copy open on "fd" the owner, mode and times of the original.
+ */
+static int
+preserve_attributes(const struct FileInfo * i, int fd)
+{
+    mode_t          mode = i->stat.st_mode & 07777;
+    struct timespec times[2];
+
+    times[0] = i->stat.st_atim;
+    times[1] = i->stat.st_mtim;
+    if ( give_away(fchown(fd, i->stat.st_uid, i->stat.st_gid), &mode) != 0
+     || fchmod(fd, mode) != 0
+     || futimens(fd, times) != 0 ) {
+        name_and_error(i->destination);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Make a name for a temporary file next to "destination".
+ */
+static char *
+temporary_name(const char * destination)
+{
+    const char *    slash = strrchr(destination, '/');
+    int             length = slash ? slash + 1 - destination : 0;
+    char *          name = malloc(strlen(destination) + 32);
+
+    if ( name )
+        sprintf(name, "%.*s.%s.%d.%d"
+        ,length
+        ,destination
+        ,&destination[length]
+        ,(int)getpid()
+        ,__sync_fetch_and_add(&serial, 1));
+    return name;
+}
+
+/*
+ * Without privilege, an O_TMPFILE can only be given a name through /proc,
+ * so one is only used when /proc is there.
+ */
+static int
+have_proc(void)
+{
+    static int  known = -1;
+    int         k = __atomic_load_n(&known, __ATOMIC_RELAXED);
+
+    if ( k < 0 ) {
+        k = ( access("/proc/self/fd", X_OK) == 0 );
+        __atomic_store_n(&known, k, __ATOMIC_RELAXED);
+    }
+    return k;
+}
+
+/*
+ * Open the file that "destination" will name when it is complete. If
+ * that has to be a temporary name, it is returned in "temporary".
+ */
+static int
+open_atomic(const char * destination, mode_t mode, char * * temporary)
+{
+    const char *        slash = strrchr(destination, '/');
+    struct PathBuffer   directory = { 0, 0, 0 };
+    int                 fd = -1;
+    int                 error = EOPNOTSUPP;
+
+    *temporary = 0;
+    if ( have_proc() ) {
+        if ( slash == 0 )
+            path_append(&directory, ".");
+        else if ( slash == destination )
+            path_append(&directory, "/");
+        else {
+            path_append(&directory, destination);
+            path_truncate(&directory, slash - destination);
+        }
+        fd = open(directory.path, O_TMPFILE|O_WRONLY, mode);
+        error = errno;
+        free(directory.path);
+    }
+    if ( fd >= 0 )
+        return fd;
+    if ( error != EOPNOTSUPP && error != EISDIR && error != EINVAL ) {
+        errno = error;
+        return -1;
+    }
+    if ( (*temporary = temporary_name(destination)) == 0 )
+        return -1;
+    if ( (fd = open(*temporary, O_WRONLY|O_CREAT|O_EXCL, mode)) < 0 ) {
+        free(*temporary);
+        *temporary = 0;
+    }
+    return fd;
+}
+
+/*
+ * Give the O_TMPFILE open on "fd" a name. That is done through /proc, as
+ * linking it by its descriptor alone takes privilege, but if /proc has
+ * gone we try that too.
+ */
+static int
+link_descriptor(int fd, const char * name)
+{
+    char    proc[64];
+
+    sprintf(proc, "/proc/self/fd/%d", fd);
+    if ( linkat(AT_FDCWD, proc, AT_FDCWD, name, AT_SYMLINK_FOLLOW) == 0 )
+        return 0;
+    if ( errno != ENOENT )
+        return -1;
+    return linkat(fd, "", AT_FDCWD, name, AT_EMPTY_PATH);
+}
+
+/*
+ * Give the complete file open on "fd" its name, replacing whatever had
+ * it. If the name is taken, an O_TMPFILE is linked under a temporary name
+ * and renamed over it.
+ */
+static int
+publish(int fd, const char * temporary, const char * destination)
+{
+    char *  t;
+    int     status;
+
+    if ( temporary )
+        return rename(temporary, destination);
+    if ( link_descriptor(fd, destination) == 0 )
+        return 0;
+    if ( errno != EEXIST || (t = temporary_name(destination)) == 0 )
+        return -1;
+    if ( (status = link_descriptor(fd, t)) == 0
+     && (status = rename(t, destination)) != 0 )
+        unlink(t);
+    free(t);
+    return status;
+}
+
+/*
+ * Note that the directory "destination" is in will need an fsync(). The
+ * walker visits the files in a directory together, so only a change of
+ * directory is kept; finish_changed() drops any that come up again.
+ */
+static void
+mark_changed(const char * destination)
+{
+    const char *    slash = strrchr(destination, '/');
+    int             length = slash ? slash - destination : 1;
+    char *          directory;
+
+    if ( slash == destination )
+        length = 1;
+    if ( lastChanged
+     && (int)strlen(lastChanged) == length
+     && strncmp(lastChanged, slash ? destination : ".", length) == 0 )
+        return;
+    if ( (directory = malloc(length + 1)) == 0 )
+        return;
+    sprintf(directory, "%.*s", length, slash ? destination : ".");
+    pthread_mutex_lock(&lock);
+    if ( changedCount == changedSize ) {
+        changedSize = changedSize ? changedSize * 2 : 64;
+        changed = realloc(changed, changedSize * sizeof(*changed));
+    }
+    changed[changedCount++] = directory;
+    pthread_mutex_unlock(&lock);
+    lastChanged = directory;
+}
+
+static int
+compare_names(const void * a, const void * b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static int
+finish_changed(void)
+{
+    int     status = 0;
+    int     n;
+
+    qsort(changed, changedCount, sizeof(*changed), compare_names);
+    for ( n = 0; n < changedCount; n++ ) {
+        int fd;
+
+        if ( n > 0 && strcmp(changed[n], changed[n - 1]) == 0 )
+            continue;
+        if ( (fd = open(changed[n], O_RDONLY|O_DIRECTORY)) < 0
+         || fsync(fd) != 0 ) {
+            name_and_error(changed[n]);
+            status = 1;
+        }
+        if ( fd >= 0 )
+            close(fd);
+    }
+    for ( n = 0; n < changedCount; n++ )
+        free(changed[n]);
+    free(changed);
+    changed = 0;
+    changedCount = changedSize = 0;
+    lastChanged = 0;
+    return status;
+}
+
+/*
+ * Copy the data, make the -p, -m, -o and -g changes, flush and publish
+ * the copy for --fsync and --atomic, and close both files.
+ */
+static int
+copy_contents(
+ const struct FileInfo *    i
+,int                        sourceFd
+,int                        destinationFd
+,const char *               temporary)
+{
+    const struct FileOptions *  o = i->options;
+    int     status = 0;
+
+    if ( copy_file(sourceFd, destinationFd, o->sparse) != 0 ) {
+        name_and_error(i->destination);
+        status = 1;
+    }
+    else if ( o->preserveAttributes
+     && preserve_attributes(i, destinationFd) != 0 )
+        status = 1;
+    else if ( o->postProcessInFunction
+     && post_process_fd(i, destinationFd) != 0 )
+        status = 1;
+    else if ( (o->syncWrites && fsync(destinationFd) != 0)
+     || (o->atomicWrites && publish(destinationFd, temporary, i->destination) != 0) ) {
+        name_and_error(i->destination);
+        status = 1;
+    }
+    if ( status != 0 && temporary )
+        unlink(temporary);
+    close(sourceFd);
+    if ( close(destinationFd) != 0 && status == 0 ) {
+        name_and_error(i->destination);
+        status = 1;
+    }
+    return status;
+}
+
+static int
+run_copy(void * argument)
+{
+    struct CopyJob *    j = (struct CopyJob *)argument;
+    int                 status;
+
+    status = copy_contents(&j->info, j->sourceFd, j->destinationFd, j->temporary);
+    free(j->destination);
+    free(j->temporary);
+    free(j);
+    return status;
+}
+
+/*
+ * Hand the copy to the pool. "temporary" becomes the job's.
+ */
+static int
+submit_copy(
+ const struct FileInfo *    i
+,struct Pool *              p
+,int                        sourceFd
+,int                        destinationFd
+,char *                     temporary)
+{
+    struct CopyJob *    j = malloc(sizeof(*j));
+    int                 status;
+
+    if ( j == 0 || (j->destination = strdup(i->destination)) == 0 ) {
+        free(j);
+        status = copy_contents(i, sourceFd, destinationFd, temporary);
+        free(temporary);
+        return status;
+    }
+    j->info = *i;
+    j->info.source = j->info.destination = j->destination;
+    j->temporary = temporary;
+    j->sourceFd = sourceFd;
+    j->destinationFd = destinationFd;
+    if ( pool_submit(p, run_copy, j, i->stat.st_size) != 0
+     && !i->options->force )
+        return 1;
+    return 0;
+}
+
+/*
+ * Remember a directory we made, if its mode has to be set or there are
+ * changes to make to it once it has been filled.
+ */
+static int
+defer_directory(const struct FileInfo * i, int fixMode)
+{
+    const struct FileOptions *  o = i->options;
+    struct Directory *          d;
+    const char *                s;
+
+    if ( !fixMode
+     && !o->preserveAttributes
+     && !o->changeMode
+     && !o->changeUserID
+     && !o->changeGroupID )
+        return 0;
+    pthread_mutex_lock(&lock);
+    if ( directoryCount == directorySize ) {
+        directorySize = directorySize ? directorySize * 2 : 64;
+        directories = realloc(directories, directorySize * sizeof(*directories));
+    }
+    d = &directories[directoryCount++];
+    d->destination = strdup(i->destination);
+    d->stat = i->stat;
+    d->fixMode = fixMode;
+    d->depth = 0;
+    for ( s = i->destination; *s; s++ )
+        d->depth += ( *s == '/' );
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+static int
+deepest_first(const void * a, const void * b)
+{
+    return ((const struct Directory *)b)->depth
+     - ((const struct Directory *)a)->depth;
+}
+
+static int
+finish_directories(struct FileOptions * o)
+{
+    int     status = 0;
+    int     n;
+
+    qsort(directories, directoryCount, sizeof(*directories), deepest_first);
+    for ( n = 0; n < directoryCount; n++ ) {
+        struct Directory *  d = &directories[n];
+        struct FileInfo     f;
+
+        memset(&f, 0, sizeof(f));
+        f.options = o;
+        f.source = f.destination = f.destinationName = d->destination;
+        f.directoryFd = f.destinationFd = AT_FDCWD;
+        f.stat = d->stat;
+        if ( o->preserveAttributes ) {
+            int fd = open(d->destination, O_RDONLY|O_DIRECTORY|O_NOFOLLOW);
+
+            if ( fd < 0 ) {
+                name_and_error(d->destination);
+                status = 1;
+            }
+            else {
+                if ( preserve_attributes(&f, fd) != 0
+                 || post_process_fd(&f, fd) != 0 )
+                    status = 1;
+                close(fd);
+            }
+            free(d->destination);
+            continue;
+        }
+        if ( d->fixMode && fchmodat(
+         AT_FDCWD
+        ,d->destination
+        ,d->stat.st_mode & 07777 & ~creationMask
+        ,0) != 0 ) {
+            name_and_error(d->destination);
+            status = 1;
+        }
+        if ( post_process_fd(&f, -1) != 0 )
+            status = 1;
+        free(d->destination);
+    }
+    free(directories);
+    directories = 0;
+    directoryCount = directorySize = 0;
+    return status;
+}
+
+/*
+ * Take out the long options, which monadic_main() doesn't know, and
+ * leave the rest to it.
+ */
+extern int
+cp_main(struct FileInfo * i, int argc, char * * argv)
+{
+    struct FileOptions *    o = i->options;
+    int     n;
+    int     count = 1;
+    int     status;
+
+    for ( n = 1; n < argc; n++ ) {
+        if ( strncmp(argv[n], "--sparse=", 9) == 0 ) {
+            if ( parse_sparse(&argv[n][9], &o->sparse) != 0 ) {
+                usage(cp_usage);
+                return 1;
+            }
+            continue;
+        }
+        if ( strncmp(argv[n], "--in-flight=", 12) == 0 ) {
+            if ( (inFlight = parse_size(&argv[n][12])) < 0 ) {
+                usage(cp_usage);
+                return 1;
+            }
+            continue;
+        }
+        if ( strcmp(argv[n], "-a") == 0 ) {
+            o->preserveAttributes = 1;
+            o->preserveLinks = 1;
+            o->recursive = 1;
+            continue;
+        }
+        if ( strcmp(argv[n], "-p") == 0 ) {
+            o->preserveAttributes = 1;
+            continue;
+        }
+        if ( strcmp(argv[n], "--atomic") == 0 ) {
+            o->atomicWrites = 1;
+            continue;
+        }
+        if ( strcmp(argv[n], "--fsync") == 0 ) {
+            o->syncWrites = 1;
+            continue;
+        }
+        if ( argv[n][0] != '-' )
+            break;
+        argv[count++] = argv[n];
+        /* Keep an option's argument with it, as dyadic_main() does. */
+        if ( argv[n][2] == '\0' && strchr("gjmo", argv[n][1]) && n + 1 < argc )
+            argv[count++] = argv[++n];
+    }
+    while ( n < argc )
+        argv[count++] = argv[n++];
+    argv[count] = 0;
+
+    o->postProcessInFunction = 1;
+    creationMask = umask(0);
+    umask(creationMask);
+    if ( o->preserveLinks && (links = hard_links_create()) == 0 ) {
+        name_and_error(argv[0]);
+        return 1;
+    }
+
+    status = dyadic_main(i, count, argv);
+
+    if ( pool != 0 && pool_finish(pool) != 0 && status == 0 )
+        status = 1;
+    pool = 0;
+    poolTried = 0;
+    if ( finish_directories(o) != 0 && status == 0 )
+        status = 1;
+    if ( finish_changed() != 0 && status == 0 )
+        status = 1;
+    if ( links ) {
+        hard_links_free(links);
+        links = 0;
+    }
+    return status;
+}
+
+static int
+copy_symbolic_link(
+ const struct FileInfo *    i
+,int                        directoryFd
+,const char *               name
+,const char *               destination)
+{
+    char            target[PATH_MAX];
+    int             length;
+    struct stat     s;
+    struct timespec times[2];
+
+    length = readlinkat(i->directoryFd, i->name, target, sizeof(target) - 1);
+    if ( length < 0 || fstatat(i->directoryFd, i->name, &s, AT_SYMLINK_NOFOLLOW) != 0 ) {
+        name_and_error(i->source);
+        return 1;
+    }
+    target[length] = '\0';
+    if ( symlinkat(target, directoryFd, name) != 0
+     && (errno != EEXIST
+      || unlinkat(directoryFd, name, 0) != 0
+      || symlinkat(target, directoryFd, name) != 0) ) {
+        name_and_error(destination);
+        return 1;
+    }
+    if ( !i->options->preserveAttributes )
+        return 0;
+    times[0] = s.st_atim;
+    times[1] = s.st_mtim;
+    if ( give_away(fchownat(directoryFd, name, s.st_uid, s.st_gid, AT_SYMLINK_NOFOLLOW)
+      ,&s.st_mode) != 0
+     || utimensat(directoryFd, name, times, AT_SYMLINK_NOFOLLOW) != 0 ) {
+        name_and_error(destination);
+        return 1;
+    }
+    return 0;
+}
+
+static int
+link_copy(
+ const char *   first
+,int            directoryFd
+,const char *   name
+,const char *   destination)
+{
+    if ( linkat(AT_FDCWD, first, directoryFd, name, 0) != 0
+     && (errno != EEXIST
+      || unlinkat(directoryFd, name, 0) != 0
+      || linkat(AT_FDCWD, first, directoryFd, name, 0) != 0) ) {
+        name_and_error(destination);
+        return 1;
+    }
+    return 0;
+}
 
 extern int
 cp_fn(const struct FileInfo * i)
@@ -19,34 +661,48 @@ cp_fn(const struct FileInfo * i)
     int         sourceFd;
     int         destinationFd;
     const char * destination = i->destination;
+    int         directoryFd = i->destinationFd;
+    const char * name = i->destinationName;
     struct stat destination_stat;
-    int         status;
-    char        buf[8192];
     char        d[PATH_MAX];
+    struct FileInfo f;
+    struct Pool * p;
+    char *      temporary = 0;
+    int         status;
+    int         linked = 0;
+    const struct FileOptions * o = i->options;
+    int         link = ( o->preserveLinks && i->isSymbolicLink );
 
-    if ( (i->stat.st_mode & S_IFMT) == S_IFDIR ) {
-        if ( mkdir(destination, i->stat.st_mode & ~S_IFMT)
-         != 0 && errno != EEXIST ) {
+    if ( !link && (i->stat.st_mode & S_IFMT) == S_IFDIR ) {
+        mode_t  mode = i->stat.st_mode & ~S_IFMT;
+        int     made;
+
+        if ( i->options->postProcessInFunction )
+            mode |= S_IRWXU;
+        made = ( mkdirat(directoryFd, name, mode) == 0 );
+        if ( !made && errno != EEXIST ) {
             name_and_error(destination);
             return 1;
         }
+        if ( made && o->syncWrites )
+            mark_changed(destination);
+        if ( i->options->postProcessInFunction )
+            return defer_directory(i, made && mode != (i->stat.st_mode & ~S_IFMT));
         return 0;
     }
-    if ( (sourceFd = open(i->source, O_RDONLY)) < 0 ) {
-        name_and_error(i->source);
-        return 1;
-    }
-    if ( stat(destination, &destination_stat) == 0 ) {
-        if ( i->stat.st_ino == destination_stat.st_ino
+    if ( fstatat(directoryFd, name, &destination_stat, 0) == 0 ) {
+        if ( !link
+         &&  i->stat.st_ino == destination_stat.st_ino
          &&  i->stat.st_dev == destination_stat.st_dev ) {
             fprintf(stderr
             ,"copy of %s to %s would copy file to itself.\n"
             ,i->source
             ,destination);
-            close(sourceFd);
             return 1;
         }
     }
+    else
+        destination_stat.st_mode = 0;
     /*
      * If the destination is a directory, create a file within it.
      */
@@ -54,36 +710,69 @@ cp_fn(const struct FileInfo * i)
 		destination = join_paths(
 		 d
 		,i->destination
-		,&i->source[i->directoryLength]);
+		,&i->source[i->options->directoryLength]);
+		directoryFd = AT_FDCWD;
+		name = destination;
 
-        if ( stat(destination, &destination_stat) == 0 ) {
+        if ( !link && stat(destination, &destination_stat) == 0 ) {
             if ( i->stat.st_ino == destination_stat.st_ino
              &&  i->stat.st_dev == destination_stat.st_dev ) {
                 fprintf(stderr
                 ,"copy of %s to %s would copy file to itself.\n"
                 ,i->source
                 ,destination);
-                close(sourceFd);
                 return 1;
             }
         }
     }
 
-    destinationFd = creat(destination, i->stat.st_mode & 07777);
+    if ( o->syncWrites )
+        mark_changed(destination);
+    if ( link )
+        return copy_symbolic_link(i, directoryFd, name, destination);
+    if ( links && i->stat.st_nlink > 1 ) {
+        const char * first = hard_link_claim(links, &i->stat, destination);
 
-    while ( (status = read(sourceFd, buf, sizeof(buf))) > 0 ) {
-        if ( write(destinationFd, buf, status) != status ) {
-            name_and_error(destination);
-            close(sourceFd);
-            close(destinationFd);
-            return 1;
-        }
+        if ( first )
+            return link_copy(first, directoryFd, name, destination);
+        linked = 1;
     }
-    close(sourceFd);
-    close(destinationFd);
-    if ( status < 0 ) {
+
+    if ( (sourceFd = openat(i->directoryFd, i->name, O_RDONLY)) < 0 ) {
         name_and_error(i->source);
+        if ( linked )
+            hard_link_done(links, &i->stat, 0);
         return 1;
     }
-    return 0;
+    if ( o->atomicWrites )
+        destinationFd = open_atomic(destination, i->stat.st_mode & 07777, &temporary);
+    else
+        destinationFd = openat(
+         directoryFd
+        ,name
+        ,O_WRONLY|O_CREAT|O_TRUNC
+        ,i->stat.st_mode & 07777);
+    if ( destinationFd < 0 ) {
+        name_and_error(destination);
+        close(sourceFd);
+        if ( linked )
+            hard_link_done(links, &i->stat, 0);
+        return 1;
+    }
+
+    f = *i;
+    f.destination = destination;
+    /*
+     * Other links to the copy can be made once it has its name: now, or
+     * for an atomic copy, once it is complete.
+     */
+    if ( linked && !o->atomicWrites )
+        hard_link_done(links, &i->stat, 1);
+    if ( (p = copy_pool(o)) != 0 && !(linked && o->atomicWrites) )
+        return submit_copy(&f, p, sourceFd, destinationFd, temporary);
+    status = copy_contents(&f, sourceFd, destinationFd, temporary);
+    free(temporary);
+    if ( linked && o->atomicWrites )
+        hard_link_done(links, &i->stat, status == 0);
+    return status;
 }
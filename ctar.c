@@ -0,0 +1,52 @@
+#include "internal.h"
+#include "tarfn.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+
+const char  ctar_usage[] = "ctar [-f archive] file [file ...]\n"
+"\n"
+"\tWrites a tar archive of the files, and of everything within the\n"
+"\tdirectories, to the standard output or to the named archive.\n"
+"\n";
+
+int
+ctar_main(struct FileInfo * i, int argc, char * * argv)
+{
+    const char *    archive = 0;
+    int fd = 1;
+    int status;
+
+    while ( argc > 1 && argv[1][0] == '-' ) {
+        if ( strcmp(argv[1], "-f") != 0 || argc < 3 ) {
+            usage(ctar_usage);
+            return 1;
+        }
+        archive = argv[2];
+        argc -= 2;
+        argv += 2;
+    }
+    if ( argc < 2 ) {
+        usage(ctar_usage);
+        return 1;
+    }
+
+    if ( archive && strcmp(archive, "-") != 0
+     && (fd = open(archive, O_WRONLY|O_CREAT|O_TRUNC, 0666)) < 0 ) {
+        name_and_error(archive);
+        return 1;
+    }
+
+    status = TarCreator(fd, i, &argv[1]);
+    if ( status < 0 ) {
+        name_and_error(archive ? archive : "stdout");
+        status = 1;
+    }
+    if ( fd != 1 && close(fd) != 0 && status == 0 ) {
+        name_and_error(archive);
+        status = 1;
+    }
+    return status;
+}
@@ -21,16 +21,44 @@
 /* Options:
 
    Numbers can be followed by a multiplier:
-   b=512, c=1, k=1024, w=2, xm=number m
+   b=512, c=1, k=1024, M=1024k, G=1024M, w=2, xm=number m
 
+   if=FILE			Read from FILE instead of the standard input.
+   of=FILE			Write to FILE instead of the standard output.
    bs=BYTES			Read and Write BYTES bytes at a time.
-   count=BLOCKS			Copy only BLOCKS input blocks. */
+   ibs=BYTES			Read BYTES bytes at a time.
+   obs=BYTES			Write BYTES bytes at a time.
+   count=BLOCKS			Copy only BLOCKS input blocks.
+   skip=BLOCKS			Skip BLOCKS input blocks first.
+   seek=BLOCKS			Skip BLOCKS output blocks first.
+   conv=CONVERSIONS		notrunc, sync, fsync, delta.
+   iflag=FLAGS			Open the input with FLAGS: direct.
+   oflag=FLAGS			Open the output with FLAGS: direct, dsync.
+   status=progress		Report the rate every second.
+   --sparse=WHEN		auto, always or never leave holes in the output.
+
+   SIGUSR1 prints the records and bytes copied so far.
+
+   A reader thread fills a ring of aligned buffers while the writer
+   empties it, so that reading and writing overlap.  Files that can seek
+   are read and written with pread() and pwrite() at our own offsets, and
+   their descriptors are left where the copy finished.
+
+   With conv=delta each output block is first read back from the output,
+   and only written if it differs, so that rewriting an image onto a
+   device that already holds most of it writes only what changed. */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <malloc.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include "internal.h"
 
 #define equal(p, q) (strcmp ((p),(q)) == 0)
@@ -40,41 +68,130 @@ static const char *program_name;
 
 const char	dd_usage[] = "dd [OPTION]\n\
 \n\
-\tCopy from stdin to stdout according to the options.\n\
+\tCopy a file, by default from stdin to stdout, according to the options.\n\
 \n\
+\t  if=FILE         read from FILE instead of stdin\n\
+\t  of=FILE         write to FILE instead of stdout\n\
 \t  bs=BYTES        read and write BYTES bytes at a time\n\
+\t  ibs=BYTES       read BYTES bytes at a time\n\
+\t  obs=BYTES       write BYTES bytes at a time\n\
 \t  count=BLOCKS    copy only BLOCKS input blocks\n\
+\t  skip=BLOCKS     skip BLOCKS ibs-sized blocks at start of input\n\
+\t  seek=BLOCKS     skip BLOCKS obs-sized blocks at start of output\n\
+\t  conv=CONVS      notrunc: don't truncate the output file,\n\
+\t                  sync: pad every input block with NULs to ibs,\n\
+\t                  fsync: write the output file to disk before finishing,\n\
+\t                  delta: only write the blocks that differ in the output\n\
+\t  iflag=FLAGS     direct: read with O_DIRECT\n\
+\t  oflag=FLAGS     direct: write with O_DIRECT,\n\
+\t                  dsync: wait for each block to reach the device\n\
+\t  status=progress print the transfer rate every second\n\
+\t  --sparse=WHEN   auto to keep the holes of a sparse input file,\n\
+\t                  always to also seek over blocks of zeros,\n\
+\t                  never (the default) to write every block\n\
 \n\
 \tBYTES may be suffixed: by xM for multiplication by M, by c for x1,\n\
-\tby w for x2, by b for x512, by k for x1024.\n";
+\tby w for x2, by b for x512, by k for x1024, by M for x1024k,\n\
+\tby G for x1024M.\n\
+\tCONVS and FLAGS are separated by commas.\n\
+\tSIGUSR1 prints the records and bytes copied so far.\n";
 
-static int parse_integer (char *str);
-static int copy (char *buf);
+static long long parse_integer (char *str);
+static int parse_flags (char *str, int *flags);
+static int parse_conversions (char *str);
+static int open_files (const char *input_name, const char *output_name);
+static int copy (void);
 
 /* Default number of bytes in which atomic reads and writes are done. */
-static long blocksize = 512;
+static long input_blocksize = 512;
+static long output_blocksize = 512;
+
+/* The files, and the offsets we read and write them at. */
+static int input_fd = STDIN_FILENO;
+static int output_fd = STDOUT_FILENO;
+static long long input_offset = 0;
+static long long output_offset = 0;
+
+/* Whether the files can seek, and so be read and written at offsets. */
+static int input_positioned = 0;
+static int output_positioned = 0;
+
+/* Blocks to skip in the input and output before copying. */
+static long long skip_records = 0;
+static long long seek_records = 0;
+
+/* conv=notrunc, conv=sync, conv=fsync and conv=delta. */
+#define C_NOTRUNC	1
+#define C_SYNC		2
+#define C_FSYNC		4
+#define C_DELTA		8
+static int conversions = 0;
+
+/* Whether to seek over holes in the output rather than writing zeros. */
+static enum SparseMode sparse = SparseNever;
+
+/* O_DIRECT and O_DSYNC, for the input and output. */
+static int input_flags = 0;
+static int output_flags = 0;
+
+/* oflag=dsync a write at a time, on a descriptor we didn't open. */
+static int dsync_writes = 0;
+
+/* oflag=dsync by fdatasync() rather than RWF_DSYNC. */
+static int datasync = 0;
 
 /* Copy only this many records.  <0 means no limit. */
-static int max_records = -1;
+static long long max_records = -1;
+
+/* Records read and written, and bytes written or seeked over in the
+   output: reported at the end, on SIGUSR1 and with status=progress. */
+static struct TransferStats stats;
 
-/* Number of partial blocks written. */
-static unsigned w_partial = 0;
+/* Where the next data and hole in the input are, for --sparse=auto. */
+static long long data = 0;
+static long long hole = 0;
 
-/* Number of full blocks written. */
-static unsigned w_full = 0;
+/* For conv=delta, what the output held, and the blocks written and left
+   alone because they were the same. */
+static char *delta_buffer = 0;
+static unsigned long long delta_written = 0;
+static unsigned long long delta_skipped = 0;
+static int truncate_at_end = 0;
 
-/* Number of partial blocks read. */
-static unsigned r_partial = 0;
+/* With obs different from ibs, output is gathered here. */
+static char *output_buffer = 0;
+static long output_length = 0;
 
-/* Number of full blocks read. */
-static unsigned r_full = 0;
+/* The reader fills these in turn and the writer empties them. */
+struct block
+{
+  char *buffer;
+  long length;			/* Bytes read, */
+  long long skip;		/* or bytes of a hole to seek over. */
+  int last;			/* There are no more after this one. */
+  int error;			/* A read error, with last. */
+};
+
+/* Up to this much memory in the ring, but at least two blocks. */
+#define RING_BYTES	(16 * 1024 * 1024)
+#define RING_MAXIMUM	8
+
+static struct block ring[RING_MAXIMUM];
+static int ring_size;
+static int ring_count = 0;	/* Blocks read and not yet written. */
+static int stopping = 0;	/* The writer has given up. */
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ring_filled = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t ring_emptied = PTHREAD_COND_INITIALIZER;
 
 extern int
 dd_main (struct FileInfo * unused, int argc, char **argv)
 {
   int exit_status;
-  unsigned char *buf;           /* Buffer. */
-  int i, n;
+  int i;
+  long long n;
+  const char *input_name = 0;
+  const char *output_name = 0;
   
   program_name = argv[0];
 
@@ -92,6 +209,59 @@ dd_main (struct FileInfo * unused, int argc, char **argv)
 	  return 1;
 	}
       *val++ = '\0';
+
+      if (equal (name, "--sparse"))
+	{
+	  if (parse_sparse (val, &sparse) != 0)
+	    {
+	      fprintf (stderr, "%s: invalid sparse mode: `%s'\n", program_name, val);
+	      return 1;
+	    }
+	  continue;
+	}
+
+      if (equal (name, "iflag") || equal (name, "oflag"))
+	{
+	  if (parse_flags (val, *name == 'i' ? &input_flags : &output_flags) != 0)
+	    {
+	      fprintf (stderr, "%s: invalid flags: `%s'\n", program_name, val);
+	      return 1;
+	    }
+	  continue;
+	}
+
+      if (equal (name, "conv"))
+	{
+	  if (parse_conversions (val) != 0)
+	    {
+	      fprintf (stderr, "%s: invalid conversions: `%s'\n", program_name, val);
+	      return 1;
+	    }
+	  continue;
+	}
+
+      if (equal (name, "status"))
+	{
+	  if (!equal (val, "progress"))
+	    {
+	      fprintf (stderr, "%s: invalid status: `%s'\n", program_name, val);
+	      return 1;
+	    }
+	  stats.progress = 1;
+	  continue;
+	}
+
+      if (equal (name, "if"))
+	{
+	  input_name = val;
+	  continue;
+	}
+
+      if (equal (name, "of"))
+	{
+	  output_name = val;
+	  continue;
+	}
       
       n = parse_integer (val);
       if (n < 0)
@@ -101,9 +271,17 @@ dd_main (struct FileInfo * unused, int argc, char **argv)
 	}
       
       if (equal (name, "bs"))
-	blocksize = n;
+	input_blocksize = output_blocksize = n;
+      else if (equal (name, "ibs"))
+	input_blocksize = n;
+      else if (equal (name, "obs"))
+	output_blocksize = n;
       else if (equal (name, "count"))
 	max_records = n;
+      else if (equal (name, "skip"))
+	skip_records = n;
+      else if (equal (name, "seek"))
+	seek_records = n;
       else
 	{
 	  fprintf (stderr, "%s: unrecognized option `%s=%s'\n", program_name, name, val);
@@ -111,58 +289,548 @@ dd_main (struct FileInfo * unused, int argc, char **argv)
 	  return 1;
 	}
     }
+
+  if (input_blocksize <= 0 || output_blocksize <= 0)
+    {
+      fprintf (stderr, "%s: invalid block size\n", program_name);
+      return 1;
+    }
+
+  if (open_files (input_name, output_name) != 0)
+    return 1;
   
-  /* allocate buffer space */
-  buf = (unsigned char *) malloc (blocksize);
-  if ( buf == 0 ) {
-    fprintf (stderr, "%s: Memory exhausted\n", program_name);
-    exit_status = 1;
-  } else {
-    exit_status = copy (buf);
-    free (buf);
-  }
-  
-  fprintf (stderr, "%u+%u records in\n", r_full, r_partial);
-  fprintf (stderr, "%u+%u records out\n", w_full, w_partial);
+  exit_status = copy ();
+  transfer_report (&stats);
+  if (conversions & C_DELTA)
+    fprintf (stderr, "%llu blocks written, %llu unchanged\n",
+	     delta_written, delta_skipped);
+
+  if (input_name)
+    close (input_fd);
+  if (output_name && close (output_fd) != 0 && exit_status == 0)
+    {
+      fprintf (stderr, "%s: %s: %s\n", program_name, output_name,
+	       strerror (errno));
+      exit_status = 1;
+    }
   
   return exit_status;
 }
 
-/* The main loop.  */
+static int
+set_flags (int fd, int flags)
+{
+  return flags == 0 ? 0 : fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | flags);
+}
+
+/* Open if= and of=, or set the flags on stdin and stdout, and find where
+   the copy starts in each. */
 
 static int
-copy (char *buf)
+open_files (const char *input_name, const char *output_name)
 {
-  int nread;			/* Bytes read in the current block. */
-  int nwrite;			/* Bytes written in the current block. */
-  
-  while (1)
+  struct stat s;
+  long long start;
+
+  if (input_name)
+    input_fd = open (input_name, O_RDONLY | input_flags);
+  else if (set_flags (input_fd, input_flags & O_DIRECT) != 0)
+    input_fd = -1;
+  if (input_fd < 0)
+    {
+      fprintf (stderr, "%s: %s: %s\n", program_name,
+	       input_name ? input_name : "stdin", strerror (errno));
+      return -1;
+    }
+
+  /* O_DSYNC can only be had at open(); on stdout it is done a write at a
+     time, with RWF_DSYNC. */
+  if (output_name)
+    output_fd = open (output_name,
+		      ((conversions & C_DELTA) ? O_RDWR : O_WRONLY) | O_CREAT
+		      | output_flags, 0666);
+  else if (set_flags (output_fd, output_flags & O_DIRECT) != 0)
+    output_fd = -1;
+  else
+    dsync_writes = (output_flags & O_DSYNC) != 0;
+  if (output_fd < 0)
+    {
+      fprintf (stderr, "%s: %s: %s\n", program_name,
+	       output_name ? output_name : "stdout", strerror (errno));
+      return -1;
+    }
+
+  if ((start = lseek (input_fd, 0, SEEK_CUR)) >= 0)
+    {
+      input_positioned = 1;
+      input_offset = start + skip_records * input_blocksize;
+    }
+  else if (skip_records > 0
+	   && skip_data (input_fd, skip_records * input_blocksize) != 0)
+    {
+      fprintf (stderr, "%s: can't skip to the input offset\n", program_name);
+      return -1;
+    }
+
+  if ((start = lseek (output_fd, 0, SEEK_CUR)) >= 0)
+    {
+      output_positioned = 1;
+      output_offset = start + seek_records * output_blocksize;
+    }
+  else if (seek_records > 0 || (conversions & C_DELTA))
+    {
+      fprintf (stderr, "%s: can't seek to the output offset: %s\n",
+	       program_name, strerror (errno));
+      return -1;
+    }
+
+  if ((conversions & C_DELTA)
+      && (fcntl (output_fd, F_GETFL) & O_ACCMODE) != O_RDWR)
+    {
+      fprintf (stderr, "%s: conv=delta needs an output that can be read\n",
+	       program_name);
+      return -1;
+    }
+
+  /* Cut the output off where we start writing, as it is when we write to
+     a new file from the start.  conv=delta needs what is there, and cuts
+     it off where the copy ends instead. */
+  if ((conversions & C_NOTRUNC) || !(output_name || seek_records > 0)
+      || fstat (output_fd, &s) != 0 || !S_ISREG (s.st_mode))
+    return 0;
+  if (conversions & C_DELTA)
+    truncate_at_end = 1;
+  else if (ftruncate (output_fd, output_offset) != 0)
+    {
+      fprintf (stderr, "%s: can't truncate the output: %s\n", program_name,
+	       strerror (errno));
+      return -1;
+    }
+  return 0;
+}
+
+/* Read the next block, or find a hole to skip.  Runs on the reader. */
+
+static void
+read_block (struct block *b)
+{
+  long n;
+
+  b->length = 0;
+  b->skip = 0;
+  b->last = 0;
+  b->error = 0;
+
+  if (max_records >= 0 && stats.partialIn + stats.fullIn >= max_records)
+    {
+      b->last = 1;
+      return;
+    }
+
+  /* Seek over whole blocks of a hole in the input. */
+  if (sparse == SparseAuto)
+    {
+      if (input_offset >= hole)
+	data = find_data (input_fd, input_offset, &hole);
+      if (data < 0)
+	sparse = SparseNever;
+      else if (data - input_offset >= input_blocksize)
+	{
+	  long long blocks = (data - input_offset) / input_blocksize;
+
+	  long long left = max_records - stats.partialIn - stats.fullIn;
+
+	  if (max_records >= 0 && blocks > left)
+	    blocks = left;
+	  input_offset += blocks * input_blocksize;
+	  stats.fullIn += blocks;
+	  b->skip = blocks * input_blocksize;
+	  return;
+	}
+    }
+
+  do
+    if (input_positioned)
+      n = pread (input_fd, b->buffer, input_blocksize, input_offset);
+    else
+      n = read (input_fd, b->buffer, input_blocksize);
+  while (n < 0 && errno == EINTR);
+
+  if (n <= 0)
+    {
+      b->last = 1;		/* EOF.  */
+      b->error = n < 0 ? errno : 0;
+      return;
+    }
+
+  input_offset += n;
+  if (n < input_blocksize)
+    {
+      stats.partialIn++;
+      if (conversions & C_SYNC)
+	{
+	  memset (b->buffer + n, 0, input_blocksize - n);
+	  n = input_blocksize;
+	}
+    }
+  else
+    stats.fullIn++;
+  b->length = n;
+}
+
+/* Write all of BUFFER at the output offset.  O_DIRECT may refuse a
+   partial block at the end, which is then written without it. */
+
+static int
+write_all (const char *buffer, long length)
+{
+  long done = 0;
+  long long offset = output_positioned ? output_offset : -1;
+
+  if (delta_buffer)
+    {
+      long n;
+
+      do
+	n = pread (output_fd, delta_buffer, length, output_offset);
+      while (n < 0 && errno == EINTR);
+      if (n == length && memcmp (delta_buffer, buffer, length) == 0)
+	{
+	  output_offset += length;
+	  delta_skipped++;
+	  return 0;
+	}
+      delta_written++;
+    }
+
+  while (done < length)
+    {
+      long n;
+
+      if (sparse == SparseAlways)
+	n = pwrite_sparse (output_fd, buffer + done, length - done, offset);
+      else if (dsync_writes)
+	{
+	  struct iovec v;
+
+	  v.iov_base = (char *) buffer + done;
+	  v.iov_len = length - done;
+	  n = pwritev2 (output_fd, &v, 1, offset, RWF_DSYNC);
+	}
+      else if (output_positioned)
+	n = pwrite (output_fd, buffer + done, length - done, offset);
+      else
+	n = write (output_fd, buffer + done, length - done);
+
+      if (n < 0 && errno == EINTR)
+	continue;
+      if (n < 0 && errno == EINVAL && (output_flags & O_DIRECT))
+	{
+	  output_flags &= ~O_DIRECT;
+	  if (fcntl (output_fd, F_SETFL,
+		     fcntl (output_fd, F_GETFL) & ~O_DIRECT) == 0)
+	    continue;
+	}
+      if (n < 0 && (errno == EOPNOTSUPP || errno == ENOSYS) && dsync_writes)
+	{
+	  /* No RWF_DSYNC: write, then fdatasync() each block. */
+	  dsync_writes = 0;
+	  datasync = 1;
+	  continue;
+	}
+      if (n <= 0)
+	return -1;
+      done += n;
+      if (offset >= 0)
+	offset += n;
+    }
+  output_offset += length;
+  if (datasync || (sparse == SparseAlways && (output_flags & O_DSYNC)))
+    return fdatasync (output_fd);
+  return 0;
+}
+
+/* Write out what has been gathered for a partial output block. */
+
+static int
+flush_output (void)
+{
+  if (output_length == 0)
+    return 0;
+  if (write_all (output_buffer, output_length) != 0)
+    return -1;
+  if (output_length == output_blocksize)
+    stats.fullOut++;
+  else
+    stats.partialOut++;
+  stats.bytes += output_length;
+  output_length = 0;
+  return 0;
+}
+
+/* Write a block, or seek over a hole.  Runs on the writer. */
+
+static int
+write_block (const struct block *b)
+{
+  long done = 0;
+
+  if (b->skip)
+    {
+      if (flush_output () != 0)
+	return -1;
+      if (!output_positioned)
+	{
+	  errno = ESPIPE;
+	  return -1;
+	}
+      output_offset += b->skip;
+      stats.fullOut += b->skip / output_blocksize;
+      stats.bytes += b->skip;
+      return 0;
+    }
+
+  /* The same block size both ways: write what was read. */
+  if (output_buffer == 0)
+    {
+      if (b->length == 0)
+	return 0;
+      if (write_all (b->buffer, b->length) != 0)
+	return -1;
+      if (b->length == output_blocksize)
+	stats.fullOut++;
+      else
+	stats.partialOut++;
+      stats.bytes += b->length;
+      return 0;
+    }
+
+  while (done < b->length)
     {
-      if (max_records >= 0 && r_partial + r_full >= max_records)
+      long n = output_blocksize - output_length;
+
+      if (n > b->length - done)
+	n = b->length - done;
+      memcpy (output_buffer + output_length, b->buffer + done, n);
+      output_length += n;
+      done += n;
+      if (output_length == output_blocksize && flush_output () != 0)
+	return -1;
+    }
+  return 0;
+}
+
+static void *
+reader (void *unused)
+{
+  int n = 0;
+
+  for (;;)
+    {
+      struct block *b = &ring[n];
+
+      pthread_mutex_lock (&ring_lock);
+      while (ring_count == ring_size && !stopping)
+	pthread_cond_wait (&ring_emptied, &ring_lock);
+      if (stopping)
+	{
+	  pthread_mutex_unlock (&ring_lock);
+	  break;
+	}
+      pthread_mutex_unlock (&ring_lock);
+
+      read_block (b);
+
+      pthread_mutex_lock (&ring_lock);
+      ring_count++;
+      pthread_cond_signal (&ring_filled);
+      pthread_mutex_unlock (&ring_lock);
+      if (b->last)
 	break;
+      n = (n + 1) % ring_size;
+    }
+  return 0;
+}
 
-      nread = read (STDIN_FILENO, buf, blocksize);
+/* The main loop.  */
 
-      if (nread == 0)
-	break;		/* EOF.  */
+static int
+copy (void)
+{
+  struct stat in, out;
+  long largest = input_blocksize > output_blocksize
+    ? input_blocksize : output_blocksize;
+  pthread_t thread;
+  int threaded;
+  int last;
+  int status = 0;
+  int n;
+
+  /* Holes can only be made in a regular file, and only found in one.  A
+     hole skipped in the output would keep what was there, so conv=delta
+     compares and writes the zeros. */
+  if (conversions & C_DELTA)
+    sparse = SparseNever;
+  if (sparse != SparseNever
+      && (fstat (output_fd, &out) != 0 || !S_ISREG (out.st_mode)))
+    sparse = SparseNever;
+  if (sparse == SparseAuto
+      && (fstat (input_fd, &in) != 0 || !S_ISREG (in.st_mode)))
+    sparse = SparseNever;
+
+  ring_size = RING_BYTES / input_blocksize;
+  if (ring_size < 2)
+    ring_size = 2;
+  if (ring_size > RING_MAXIMUM)
+    ring_size = RING_MAXIMUM;
+  for (n = 0; n < ring_size; n++)
+    {
+      /* O_DIRECT wants buffers aligned to the device's blocks. */
+      if (posix_memalign ((void **) &ring[n].buffer, 4096,
+			  (input_blocksize + 4095) & ~4095L) != 0)
+	{
+	  fprintf (stderr, "%s: Memory exhausted\n", program_name);
+	  return 1;
+	}
+    }
+  if (output_blocksize != input_blocksize
+      && posix_memalign ((void **) &output_buffer, 4096,
+			 (output_blocksize + 4095) & ~4095L) != 0)
+    {
+      fprintf (stderr, "%s: Memory exhausted\n", program_name);
+      return 1;
+    }
+  if ((conversions & C_DELTA)
+      && posix_memalign ((void **) &delta_buffer, 4096,
+			 (largest + 4095) & ~4095L) != 0)
+    {
+      fprintf (stderr, "%s: Memory exhausted\n", program_name);
+      return 1;
+    }
 
-      if (nread < 0)
-	return -2;
+  stats.records = 1;
+  transfer_start (&stats);
+  threaded = (pthread_create (&thread, 0, reader, 0) == 0);
+
+  for (n = 0; ; n = (n + 1) % ring_size)
+    {
+      struct block *b = &ring[n];
 
-      if (nread < blocksize)
-	r_partial++;
+      if (threaded)
+	{
+	  pthread_mutex_lock (&ring_lock);
+	  while (ring_count == 0)
+	    pthread_cond_wait (&ring_filled, &ring_lock);
+	  pthread_mutex_unlock (&ring_lock);
+	}
       else
-	r_full++;
+	read_block (b);
 
-      nwrite = write (STDOUT_FILENO, buf, nread);
+      if (write_block (b) != 0 || (b->last && flush_output () != 0))
+	{
+	  fprintf (stderr, "%s: write error: %s\n", program_name,
+		   strerror (errno));
+	  status = 1;
+	}
+      else if (b->error)
+	{
+	  fprintf (stderr, "%s: read error: %s\n", program_name,
+		   strerror (b->error));
+	  status = 1;
+	}
+      last = b->last;
+
+      /* The reader may fill the block again once it is given back. */
+      if (threaded)
+	{
+	  pthread_mutex_lock (&ring_lock);
+	  ring_count--;
+	  if (status != 0)
+	    stopping = 1;
+	  pthread_cond_signal (&ring_emptied);
+	  pthread_mutex_unlock (&ring_lock);
+	}
+      if (status != 0 || last)
+	break;
+    }
+
+  /* The reader may be waiting in read(); it is left to the exit. */
+  if (threaded && status == 0)
+    pthread_join (thread, 0);
+
+  /* Leave the descriptors where the copy finished, as read() and write()
+     would have, for whoever shares them. */
+  if (input_positioned)
+    lseek (input_fd, input_offset, SEEK_SET);
+  if (output_positioned && lseek (output_fd, output_offset, SEEK_SET) < 0)
+    output_positioned = 0;
+
+  if (status == 0 && truncate_at_end
+      && ftruncate (output_fd, output_offset) != 0)
+    {
+      fprintf (stderr, "%s: can't truncate the output: %s\n", program_name,
+	       strerror (errno));
+      status = 1;
+    }
 
-      if (nwrite < 0)
+  if (status == 0
+      && ((sparse != SparseNever && finish_sparse (output_fd) != 0)
+	  || ((conversions & C_FSYNC) && fsync (output_fd) != 0)))
+    {
+      fprintf (stderr, "%s: write error: %s\n", program_name, strerror (errno));
+      status = 1;
+    }
+
+  transfer_finish (&stats);
+
+  if (status == 0)
+    {
+      for (n = 0; n < ring_size; n++)
+	free (ring[n].buffer);
+      free (output_buffer);
+      free (delta_buffer);
+    }
+  return status;
+}
+
+/* Parse a list of flags separated by commas into open() flags. */
+
+static int
+parse_flags (char *str, int *flags)
+{
+  char *flag;
+
+  for (flag = strtok (str, ","); flag; flag = strtok (0, ","))
+    {
+      if (equal (flag, "direct"))
+	*flags |= O_DIRECT;
+      else if (equal (flag, "dsync"))
+	*flags |= O_DSYNC;
+      else
 	return -1;
+    }
+  return 0;
+}
 
-      if (nwrite == blocksize)
-	w_full++;
+/* Parse a list of conversions separated by commas. */
+
+static int
+parse_conversions (char *str)
+{
+  char *conversion;
+
+  for (conversion = strtok (str, ","); conversion; conversion = strtok (0, ","))
+    {
+      if (equal (conversion, "notrunc"))
+	conversions |= C_NOTRUNC;
+      else if (equal (conversion, "sync"))
+	conversions |= C_SYNC;
+      else if (equal (conversion, "fsync"))
+	conversions |= C_FSYNC;
+      else if (equal (conversion, "delta"))
+	conversions |= C_DELTA;
       else
-	w_partial++;
+	return -1;
     }
   return 0;
 }
@@ -171,14 +839,16 @@ copy (char *buf)
    optionally multiplied by various values.
    Return -1 if STR does not represent a number in this format. */
 
-static int
+static long long
 parse_integer (char *str)
 {
-  register int n = 0;
-  register int temp;
+  register long long n = 0;
+  register long long temp;
   char *p = str;
 
-  n = strtoul (p,&p,10);
+  if (*p < '0' || *p > '9')
+    return -1;
+  n = strtoull (p,&p,10);
 
 loop:
   switch (*p++)
@@ -193,6 +863,12 @@ loop:
     case 'k':
       n *= 1024;
       goto loop;
+    case 'M':
+      n *= 1024 * 1024;
+      goto loop;
+    case 'G':
+      n *= 1024 * 1024 * 1024;
+      goto loop;
     case 'w':
       n *= 2;
       goto loop;
@@ -1,123 +1,303 @@
 #include "internal.h"
 #include <stdio.h>
-#include <dirent.h>
 #include <string.h>
+#include <fcntl.h>
+#include <dirent.h>
 #include <errno.h>
 
 static int
-noDots(struct dirent * e)
+needs_full_stat(const struct FileInfo * i)
 {
-	if ( e->d_name[0] == '.'
-	 && (e->d_name[1] == '\0'
-	  || (e->d_name[1] == '.' && e->d_name[2] == '\0')) )
-		return 0;
-	else
-		return 1;
+	const struct FileOptions *	o = i->options;
+
+	return ( o->applet == 0
+	 || o->applet->statNeeds == NeedFullStat
+	 || o->changeMode
+	 || o->changeUserID
+	 || o->changeGroupID );
 }
 
+/*
+ * Fill in i->stat for "name" within the directory open on "fd". Symbolic
+ * links are followed for the stat, but remembered in isSymbolicLink.
+ * "type" is the directory entry's d_type, or DT_UNKNOWN; if the applet
+ * only wants to know the file type, that is all we fill in.
+ */
 extern int
-descend(
- struct FileInfo *oldInfo
-,int 		(*function)(const struct FileInfo * i))
+stat_entry(
+ int fd
+,const char * name
+,unsigned char type
+,struct FileInfo * i)
 {
-	char			pathname[1024];
-	struct dirent * *	names;
-	struct dirent * *	n;
-	int			length;
-	char *			filename;
-	int			status = 0;
-	int			count;
+	if ( type != DT_UNKNOWN && !needs_full_stat(i) ) {
+		memset((void *)&i->stat, 0, sizeof(i->stat));
+		i->stat.st_mode = DTTOIF(type);
+		i->isSymbolicLink = (type == DT_LNK);
+		return 0;
+	}
 
-	if ( *oldInfo->source == '\0' ) {
-		errno = EINVAL;
+	if ( fstatat(fd, name, &i->stat, AT_SYMLINK_NOFOLLOW) != 0 )
 		return -1;
+	i->isSymbolicLink = ((i->stat.st_mode & S_IFMT) == S_IFLNK);
+
+	if ( i->isSymbolicLink )
+		if ( fstatat(fd, name, &i->stat, 0) != 0 )
+			memset((void *)&i->stat, 0, sizeof(i->stat));
+	return 0;
+}
+
+struct Walk {
+	int 		(*function)(const struct FileInfo * i);
+	struct PathBuffer	source;
+	struct PathBuffer	destination;
+	int			depth;
+};
+
+static int
+visit(struct Walk * w, const struct FileInfo * i)
+{
+	int	status = 0;
+
+	if ( w->function )
+		status = (*w->function)(i);
+	if ( status == 0 )
+		status = post_process(i);
+	return status;
+}
+
+/*
+ * The path buffers may have moved while we were below "directory". Point
+ * its names back into them. The offsets are -1 for the argument the walk
+ * started from, whose names belong to the caller.
+ */
+static void
+refresh(
+ struct Walk *		w
+,struct FileInfo *	directory
+,int				nameOffset
+,int				destinationOffset)
+{
+	if ( nameOffset < 0 )
+		return;
+
+	directory->source = w->source.path;
+	directory->name = &w->source.path[nameOffset];
+	if ( directory->options->dyadic ) {
+		directory->destination = w->destination.path;
+		directory->destinationName = &w->destination.path[destinationOffset];
+	}
+	else {
+		directory->destination = directory->source;
+		directory->destinationName = directory->name;
 	}
+}
 
-	if ( oldInfo->stat.st_dev == 0
-	 && oldInfo->stat.st_ino == 0
-	 && oldInfo->stat.st_mode == 0 ) {
-		if ( lstat(oldInfo->source, &oldInfo->stat) != 0 )
-			return -1;
-		oldInfo->isSymbolicLink = ((oldInfo->stat.st_mode & S_IFMT) == S_IFLNK);
+static int
+walk(
+ struct Walk *		w
+,struct FileInfo *	directory
+,int				nameOffset
+,int				destinationOffset)
+{
+	const struct FileOptions *	o = directory->options;
+	struct DirectoryStream	d;
+	struct FileInfo		entry;
+	const char *		name;
+	unsigned char		type;
+	int			destinationFd = -1;
+	int			status = 0;
 
-		if ( oldInfo->isSymbolicLink )
-			if ( stat(oldInfo->source, &oldInfo->stat) != 0 )
-				memset((void *)&oldInfo->stat, 0, sizeof(oldInfo->stat));
+	if ( !o->processDirectoriesAfterTheirContents ) {
+		status = visit(w, directory);
+		if ( status != 0 && !o->force )
+			return status;
 	}
 
-	if ( !oldInfo->processDirectoriesAfterTheirContents ) {
-		if ( function )
-			status = (*function)(oldInfo);
-		if ( status == 0 )
-			status = post_process(oldInfo);
+	if ( open_directory(
+	 &d
+	,directory->directoryFd
+	,directory->name
+	,!o->unsorted) != 0 ) {
+		name_and_error(directory->source);
+		return 1;
 	}
 
-	if ( (count = scandir(oldInfo->source, &names, noDots, alphasort)) < 0 )
-		return -1;
+	/*
+	 * The function has made the destination directory by now. If it
+	 * can't be opened, fall back to using the whole path.
+	 */
+	if ( o->dyadic )
+		destinationFd = openat(
+		 directory->destinationFd
+		,directory->destinationName
+		,O_RDONLY|O_DIRECTORY);
 
-	length = strlen(oldInfo->source);
-	if ( oldInfo->source[length-1] == '/' )
-		length--;
+	memset((void *)&entry, 0, sizeof(entry));
+	entry.options = directory->options;
 
-	memcpy(pathname, oldInfo->source, length+1);
-	pathname[length] = '/';
-	filename = &pathname[length+1];
-	
-	n = names;
-	while ( count-- > 0 ) {
-		struct FileInfo		i = *oldInfo;
+	while ( (name = read_directory(&d, &type)) != 0 ) {
+		int	length = strlen(name);
+		int	sourceLength = path_append(&w->source, name);
+		int	destinationLength = 0;
+		int	entryOffset = w->source.length - length;
+		int	entryDestinationOffset = -1;
 
-		strcpy(filename, (*n)->d_name);
-		free(*n++);
+		entry.source = w->source.path;
+		entry.directoryFd = d.fd;
+		entry.name = &w->source.path[entryOffset];
 
-		if ( lstat(pathname, &i.stat) != 0 && errno != ENOENT ) {
-			fprintf(stderr, "Can't stat %s: %s\n", pathname, strerror(errno));
-			return -1;
+		if ( stat_entry(d.fd, name, type, &entry) != 0 ) {
+			int	error = errno;
+
+			if ( error != ENOENT )
+				fprintf(stderr, "Can't stat %s: %s\n"
+				 ,w->source.path, strerror(error));
+			path_truncate(&w->source, sourceLength);
+			if ( error == ENOENT )
+				continue;
+			status = -1;
+			break;
 		}
-		i.isSymbolicLink = ((i.stat.st_mode & S_IFMT) == S_IFLNK);
 
-		if ( i.isSymbolicLink )
-			if ( stat(pathname, &i.stat) != 0 )
-				memset((void *)&i.stat, 0, sizeof(i.stat));
+		if ( o->dyadic ) {
+			destinationLength = path_append(&w->destination, name);
+			entry.destination = w->destination.path;
+			if ( destinationFd >= 0 ) {
+				entryDestinationOffset = w->destination.length - length;
+				entry.destinationFd = destinationFd;
+			}
+			else {
+				entryDestinationOffset = 0;
+				entry.destinationFd = AT_FDCWD;
+			}
+			entry.destinationName = &w->destination.path[entryDestinationOffset];
+		}
+		else {
+			entry.destination = entry.source;
+			entry.destinationFd = entry.directoryFd;
+			entry.destinationName = entry.name;
+		}
 
-		i.source = pathname;
+		if ( !entry.isSymbolicLink && (entry.stat.st_mode & S_IFMT) == S_IFDIR ) {
+			/*
+			 * Below OPEN_DEPTH, the directory's descriptors are closed
+			 * while we are in a subdirectory and opened again by path
+			 * after.
+			 */
+			int	closed = ( w->depth >= OPEN_DEPTH );
 
-		if ( i.dyadic ) {
-			char	d[1024];
+			/* Queued operations refer to d.fd. */
+			if ( closed
+			 && ((status = batch_flush()) != 0 || suspend_directory(&d) != 0) ) {
+				path_truncate(&w->source, sourceLength);
+				if ( o->dyadic )
+					path_truncate(&w->destination, destinationLength);
+				if ( status == 0 )
+					name_and_error(w->source.path);
+				status = 1;
+				break;
+			}
+			if ( closed ) {
+				entry.directoryFd = AT_FDCWD;
+				entry.name = entry.source;
+				entryOffset = 0;
+				if ( o->dyadic ) {
+					entry.destinationFd = AT_FDCWD;
+					entry.destinationName = entry.destination;
+					entryDestinationOffset = 0;
+				}
+				else {
+					entry.destinationFd = entry.directoryFd;
+					entry.destinationName = entry.name;
+				}
+				if ( destinationFd >= 0 )
+					close(destinationFd);
+			}
+			w->depth++;
+			status = walk(w, &entry, entryOffset, entryDestinationOffset);
+			w->depth--;
 
-			i.destination = join_paths(d, i.destination, &i.source[i.directoryLength]);
+			path_truncate(&w->source, sourceLength);
+			if ( o->dyadic )
+				path_truncate(&w->destination, destinationLength);
+			if ( closed ) {
+				if ( resume_directory(&d, AT_FDCWD, w->source.path) != 0 ) {
+					name_and_error(w->source.path);
+					status = 1;
+					break;
+				}
+				if ( destinationFd >= 0 )
+					destinationFd = open(w->destination.path, O_RDONLY|O_DIRECTORY);
+			}
 		}
-		else
-			i.destination = i.source;
-
-		 if ( !i.isSymbolicLink && (i.stat.st_mode & S_IFMT) == S_IFDIR )
-			status = descend(&i, function);
 		else {
-			if ( function )
-				status = (*function)(&i);
-			if ( status == 0 )
-				status = post_process(&i);
-		}
+			status = visit(w, &entry);
 
-		if ( !i.processDirectoriesAfterTheirContents
-		 && status == 0
-		 && (i.stat.st_mode & S_IFMT) == S_IFDIR )
-			descend(&i, function);
+			path_truncate(&w->source, sourceLength);
+			if ( o->dyadic )
+				path_truncate(&w->destination, destinationLength);
+		}
 
-		if ( status != 0 && !i.force ) {
-			while ( count-- > 0 )
-				free(*n++);
+		if ( status != 0 && !o->force )
 			break;
-		}
 	}
-	free(names);
+	refresh(w, directory, nameOffset, destinationOffset);
 
-	if ( oldInfo->processDirectoriesAfterTheirContents ) {
-		if ( function )
-			status = (*function)(oldInfo);
-		if ( status == 0 )
-			status = post_process(oldInfo);
+	/* Queued operations refer to d.fd, and must be done before we go on. */
+	if ( batch_flush() != 0 && status == 0 )
+		status = 1;
+
+	if ( d.error != 0 && status == 0 ) {
+		errno = d.error;
+		name_and_error(directory->source);
+		status = 1;
 	}
+	close_directory(&d);
+	if ( destinationFd >= 0 )
+		close(destinationFd);
+
+	if ( status < 0 )
+		return status;
+
+	if ( o->processDirectoriesAfterTheirContents )
+		status = visit(w, directory);
+
+	return status;
+}
+
+extern int
+descend(
+ struct FileInfo *info
+,int 		(*function)(const struct FileInfo * i))
+{
+	struct Walk	w;
+	int			status;
+
+	if ( info->options->threads > 1 )
+		return parallel_descend(info, function);
+
+	if ( *info->source == '\0' ) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if ( info->stat.st_dev == 0
+	 && info->stat.st_ino == 0
+	 && info->stat.st_mode == 0 ) {
+		if ( stat_entry(info->directoryFd, info->name, DT_UNKNOWN, info) != 0 )
+			return -1;
+	}
+
+	memset((void *)&w, 0, sizeof(w));
+	w.function = function;
+	path_append(&w.source, info->source);
+	if ( info->options->dyadic )
+		path_append(&w.destination, info->destination);
+
+	status = walk(&w, info, -1, -1);
 
+	free(w.source.path);
+	free(w.destination.path);
 	return status;
 }
@@ -0,0 +1,177 @@
+#include "internal.h"
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/syscall.h>
+
+/*
+ * Read directories with getdents64() in large batches, rather than one
+ * malloc()ed dirent per entry as scandir() does. An unsorted stream hands
+ * out entries as each batch arrives and never holds more than one batch.
+ * A sorted stream reads the whole directory into one arena and sorts an
+ * array of pointers into it.
+ */
+
+#define	BATCH_SIZE	(64 * 1024)
+
+struct linux_dirent64 {
+	unsigned long long	d_ino;
+	long long			d_off;
+	unsigned short		d_reclen;
+	unsigned char		d_type;
+	char				d_name[1];
+};
+
+static int
+is_dots(const char * name)
+{
+	return ( name[0] == '.'
+	 && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')) );
+}
+
+static int
+compare_entries(const void * a, const void * b)
+{
+	return strcmp(
+	 (*(struct linux_dirent64 * *)a)->d_name
+	,(*(struct linux_dirent64 * *)b)->d_name);
+}
+
+static int
+read_batch(struct DirectoryStream * d)
+{
+	int	n;
+
+	if ( d->size - d->length < BATCH_SIZE ) {
+		d->size = d->length + BATCH_SIZE;
+		if ( (d->buffer = realloc(d->buffer, d->size)) == 0 ) {
+			d->error = ENOMEM;
+			return -1;
+		}
+	}
+	n = syscall(SYS_getdents64, d->fd, &d->buffer[d->length], BATCH_SIZE);
+	if ( n < 0 )
+		d->error = errno;
+	else
+		d->length += n;
+	return n;
+}
+
+/*
+ * The directory is opened relative to "fd", which may be AT_FDCWD. Its own
+ * descriptor is left in d->fd for the caller's *at() calls.
+ */
+extern int
+open_directory(
+ struct DirectoryStream * d
+,int fd
+,const char * name
+,int sorted)
+{
+	memset(d, 0, sizeof(*d));
+	d->sorted = sorted;
+
+	if ( (d->fd = openat(fd, name, O_RDONLY|O_DIRECTORY)) < 0 )
+		return -1;
+
+	if ( sorted ) {
+		int		offset;
+		int		n;
+
+		while ( (n = read_batch(d)) > 0 )
+			;
+		if ( n < 0 ) {
+			errno = d->error;
+			close_directory(d);
+			return -1;
+		}
+		for ( offset = 0; offset < d->length; ) {
+			struct linux_dirent64 *	e
+			 = (struct linux_dirent64 *)&d->buffer[offset];
+
+			if ( !is_dots(e->d_name) )
+				d->count++;
+			offset += e->d_reclen;
+		}
+		d->entries = malloc((d->count + 1) * sizeof(*d->entries));
+		for ( offset = 0, n = 0; offset < d->length; ) {
+			struct linux_dirent64 *	e
+			 = (struct linux_dirent64 *)&d->buffer[offset];
+
+			if ( !is_dots(e->d_name) )
+				d->entries[n++] = e;
+			offset += e->d_reclen;
+		}
+		qsort(d->entries, d->count, sizeof(*d->entries), compare_entries);
+	}
+	return 0;
+}
+
+extern const char *
+read_directory(struct DirectoryStream * d, unsigned char * type)
+{
+	struct linux_dirent64 *	e;
+
+	if ( d->sorted ) {
+		if ( d->next >= d->count )
+			return 0;
+		e = (struct linux_dirent64 *)d->entries[d->next++];
+	}
+	else {
+		do {
+			if ( d->offset >= d->length ) {
+				d->offset = d->length = 0;
+				if ( read_batch(d) <= 0 )
+					return 0;
+			}
+			e = (struct linux_dirent64 *)&d->buffer[d->offset];
+			d->offset += e->d_reclen;
+		} while ( is_dots(e->d_name) );
+	}
+	if ( type )
+		*type = e->d_type;
+	return e->d_name;
+}
+
+/*
+ * Close the directory's descriptor for now, keeping our place in it, and
+ * open it again later, perhaps by another name. An unsorted stream goes
+ * on from where the kernel had got to; the batch it has in hand is kept.
+ */
+extern int
+suspend_directory(struct DirectoryStream * d)
+{
+	if ( !d->sorted && (d->position = lseek(d->fd, 0, SEEK_CUR)) < 0 )
+		return -1;
+	close(d->fd);
+	d->fd = -1;
+	return 0;
+}
+
+extern int
+resume_directory(struct DirectoryStream * d, int fd, const char * name)
+{
+	if ( (d->fd = openat(fd, name, O_RDONLY|O_DIRECTORY)) < 0 )
+		return -1;
+	if ( !d->sorted && lseek(d->fd, d->position, SEEK_SET) < 0 ) {
+		close(d->fd);
+		d->fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+extern int
+close_directory(struct DirectoryStream * d)
+{
+	int	status = 0;
+
+	if ( d->fd >= 0 )
+		status = close(d->fd);
+	free(d->buffer);
+	free(d->entries);
+	d->fd = -1;
+	d->buffer = 0;
+	d->entries = 0;
+	return status;
+}
@@ -1,5 +1,6 @@
 #include "internal.h"
 #include <stdio.h>
+#include <string.h>
 
 extern int
 dyadic_main(
@@ -9,13 +10,15 @@ dyadic_main(
 {
 	int		flags;
 
-	i->dyadic = 1;
+	i->options->dyadic = 1;
 	i->destination = argv[argc - 1];
 
-	for ( flags = 0; flags < (argc - 1) && argv[flags + 1][0] == '-' ; flags++ )
-		;
+	for ( flags = 0; flags < (argc - 1) && argv[flags + 1][0] == '-' ; flags++ ) {
+		if ( argv[flags + 1][2] == '\0' && strchr("gjmo", argv[flags + 1][1]) )
+			flags++;	/* Skip the option's argument */
+	}
 	if ( argc - flags < 3 ) {
-		usage(i->applet->usage);
+		usage(i->options->applet->usage);
 		return 1;
 	}
 	else if ( argc - flags > 3 ) {
@@ -2,15 +2,18 @@
 #include <errno.h>
 #include <stdio.h>
 
-const char	find_usage[] = "find dir [pattern]\n"
+const char	find_usage[] = "find [-j threads] dir [pattern]\n"
 "\n"
-"\tFind files.\n";
+"\tFind files.\n"
+"\n"
+"\t-j:\tUse this many threads to walk the directory tree.\n";
 
 extern int
 find_main(struct FileInfo * i, int argc, char * * argv)
 {
-	i->recursive=1;
-	i->processDirectoriesAfterTheirContents=1;
+	i->options->recursive=1;
+	i->options->processDirectoriesAfterTheirContents=1;
+	i->options->unsorted=1;
 	return monadic_main(i, argc, argv);
 }
 
@@ -0,0 +1,178 @@
+#include "internal.h"
+#include <pthread.h>
+
+/*
+ * A table of the files with more than one link that a copy has seen, by
+ * device and inode number, with the name each was first given. Later
+ * links to the same file can then be made links to that name, instead of
+ * copies. The table may be used by several threads at once.
+ *
+ * A thread that claims a name must make the file before others can link
+ * to it. Until it says it is done, they wait. If it couldn't make the
+ * file, the next thread to come along claims the name in its place.
+ */
+
+enum LinkState {
+	LinkReady = 0,
+	LinkPending,
+	LinkFailed
+};
+
+struct HardLink {
+	dev_t			device;
+	ino_t			inode;
+	char *			name;
+	enum LinkState	state;
+};
+
+struct HardLinks {
+	pthread_mutex_t	lock;
+	pthread_cond_t	done;
+	struct HardLink *	links;
+	int				count;
+	int				size;		/* Always a power of two */
+};
+
+static unsigned long
+hash(dev_t device, ino_t inode)
+{
+	unsigned long	h = (unsigned long)inode * 0x9e3779b97f4a7c15UL;
+
+	return h ^ ((unsigned long)device * 0xc2b2ae3d27d4eb4fUL) ^ (h >> 29);
+}
+
+static struct HardLink *
+slot(struct HardLink * links, int size, dev_t device, ino_t inode)
+{
+	unsigned long	n = hash(device, inode) & (size - 1);
+
+	while ( links[n].name != 0
+	 && (links[n].device != device || links[n].inode != inode) )
+		n = (n + 1) & (size - 1);
+	return &links[n];
+}
+
+static int
+grow(struct HardLinks * h)
+{
+	int					size = h->size ? h->size * 2 : 256;
+	struct HardLink *	links = calloc(size, sizeof(*links));
+	int					n;
+
+	if ( links == 0 )
+		return -1;
+	for ( n = 0; n < h->size; n++ ) {
+		if ( h->links[n].name )
+			*slot(links, size, h->links[n].device, h->links[n].inode)
+			 = h->links[n];
+	}
+	free(h->links);
+	h->links = links;
+	h->size = size;
+	return 0;
+}
+
+extern struct HardLinks *
+hard_links_create(void)
+{
+	struct HardLinks *	h = malloc(sizeof(*h));
+
+	if ( h == 0 )
+		return 0;
+	memset(h, 0, sizeof(*h));
+	pthread_mutex_init(&h->lock, 0);
+	pthread_cond_init(&h->done, 0);
+	return h;
+}
+
+static const char *
+find(
+ struct HardLinks *	h
+,const struct stat *	s
+,const char *		name
+,enum LinkState		state)
+{
+	struct HardLink *	l;
+	const char *		found = 0;
+
+	pthread_mutex_lock(&h->lock);
+	for ( ; ; ) {
+		if ( (h->count + 1) * 2 > h->size && grow(h) != 0 ) {
+			pthread_mutex_unlock(&h->lock);
+			return 0;
+		}
+		l = slot(h->links, h->size, s->st_dev, s->st_ino);
+		if ( l->name == 0 || l->state != LinkPending )
+			break;
+		pthread_cond_wait(&h->done, &h->lock);
+	}
+	if ( l->name && l->state == LinkReady )
+		found = l->name;
+	else if ( l->name ) {
+		char *	copy = strdup(name);
+
+		if ( copy ) {
+			free(l->name);
+			l->name = copy;
+			l->state = state;
+		}
+	}
+	else if ( (l->name = strdup(name)) != 0 ) {
+		l->device = s->st_dev;
+		l->inode = s->st_ino;
+		l->state = state;
+		h->count++;
+	}
+	pthread_mutex_unlock(&h->lock);
+	return found;
+}
+
+/*
+ * If the file "s" describes has been seen before, return the name it was
+ * given then. If not, remember "name" for it and return 0. The name
+ * returned stays valid until the table is freed.
+ */
+extern const char *
+hard_link_find(struct HardLinks * h, const struct stat * s, const char * name)
+{
+	return find(h, s, name, LinkReady);
+}
+
+/*
+ * As hard_link_find(), but when 0 is returned, "name" is only claimed:
+ * anyone else who finds it waits until hard_link_done() says whether
+ * the file was made.
+ */
+extern const char *
+hard_link_claim(struct HardLinks * h, const struct stat * s, const char * name)
+{
+	return find(h, s, name, LinkPending);
+}
+
+extern void
+hard_link_done(struct HardLinks * h, const struct stat * s, int made)
+{
+	struct HardLink *	l;
+
+	pthread_mutex_lock(&h->lock);
+	if ( h->size > 0 ) {
+		l = slot(h->links, h->size, s->st_dev, s->st_ino);
+		if ( l->name && l->state == LinkPending )
+			l->state = made ? LinkReady : LinkFailed;
+	}
+	pthread_cond_broadcast(&h->done);
+	pthread_mutex_unlock(&h->lock);
+}
+
+extern void
+hard_links_free(struct HardLinks * h)
+{
+	int	n;
+
+	for ( n = 0; n < h->size; n++ )
+		free(h->links[n].name);
+	free(h->links);
+	pthread_cond_destroy(&h->done);
+	pthread_mutex_destroy(&h->lock);
+	free(h);
+}
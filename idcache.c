@@ -0,0 +1,177 @@
+#include "internal.h"
+#include <pwd.h>
+#include <grp.h>
+#include <pthread.h>
+
+/*
+ * User and group names and IDs, looked up once and remembered. Under NSS
+ * every getpwnam() may parse /etc/passwd again, or ask nscd; an archive
+ * or a directory listing asks about the same few owners over and over.
+ * Names that don't exist are remembered too. The names returned stay
+ * valid until id_cache_free().
+ */
+
+enum IdTable {
+	UsersByName = 0,
+	GroupsByName,
+	UsersByID,
+	GroupsByID,
+	IdTables
+};
+
+#define	BUCKETS	64		/* A power of two */
+
+struct IdEntry {
+	struct IdEntry *	next;
+	unsigned int		id;
+	int					found;
+	char				name[1];
+};
+
+static struct IdEntry *	tables[IdTables][BUCKETS];
+static pthread_mutex_t	lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int
+hash_name(const char * s)
+{
+	unsigned int	h = 2166136261U;
+
+	while ( *s )
+		h = (h ^ (unsigned char)*s++) * 16777619U;
+	return h;
+}
+
+static struct IdEntry *
+add(enum IdTable t, unsigned int bucket, const char * name, unsigned int id, int found)
+{
+	struct IdEntry *	e = malloc(sizeof(*e) + strlen(name));
+
+	if ( e == 0 )
+		return 0;
+	strcpy(e->name, name);
+	e->id = id;
+	e->found = found;
+	e->next = tables[t][bucket];
+	tables[t][bucket] = e;
+	return e;
+}
+
+/*
+ * Find "name" in the users or groups, returning its ID in "id". Returns
+ * 0, or -1 if there is no such name.
+ */
+static int
+id_of(enum IdTable t, const char * name, unsigned int * id)
+{
+	unsigned int		bucket = hash_name(name) & (BUCKETS - 1);
+	struct IdEntry *	e;
+	int					status = -1;
+
+	pthread_mutex_lock(&lock);
+	for ( e = tables[t][bucket]; e != 0; e = e->next ) {
+		if ( strcmp(e->name, name) == 0 )
+			break;
+	}
+	if ( e == 0 ) {
+		if ( t == UsersByName ) {
+			struct passwd *	p = getpwnam(name);
+
+			e = add(t, bucket, name, p ? p->pw_uid : 0, p != 0);
+		}
+		else {
+			struct group *	g = getgrnam(name);
+
+			e = add(t, bucket, name, g ? g->gr_gid : 0, g != 0);
+		}
+	}
+	if ( e != 0 && e->found ) {
+		*id = e->id;
+		status = 0;
+	}
+	pthread_mutex_unlock(&lock);
+	return status;
+}
+
+/*
+ * The name of user or group "id", or 0 if it has none.
+ */
+static const char *
+name_of(enum IdTable t, unsigned int id)
+{
+	unsigned int		bucket = id & (BUCKETS - 1);
+	struct IdEntry *	e;
+
+	pthread_mutex_lock(&lock);
+	for ( e = tables[t][bucket]; e != 0; e = e->next ) {
+		if ( e->id == id )
+			break;
+	}
+	if ( e == 0 ) {
+		if ( t == UsersByID ) {
+			struct passwd *	p = getpwuid(id);
+
+			e = add(t, bucket, p ? p->pw_name : "", id, p != 0);
+		}
+		else {
+			struct group *	g = getgrgid(id);
+
+			e = add(t, bucket, g ? g->gr_name : "", id, g != 0);
+		}
+	}
+	pthread_mutex_unlock(&lock);
+	return e != 0 && e->found ? e->name : 0;
+}
+
+extern int
+user_id(const char * name, uid_t * id)
+{
+	unsigned int	n;
+
+	if ( id_of(UsersByName, name, &n) != 0 )
+		return -1;
+	*id = n;
+	return 0;
+}
+
+extern int
+group_id(const char * name, gid_t * id)
+{
+	unsigned int	n;
+
+	if ( id_of(GroupsByName, name, &n) != 0 )
+		return -1;
+	*id = n;
+	return 0;
+}
+
+extern const char *
+user_name(uid_t id)
+{
+	return name_of(UsersByID, id);
+}
+
+extern const char *
+group_name(gid_t id)
+{
+	return name_of(GroupsByID, id);
+}
+
+extern void
+id_cache_free(void)
+{
+	int	t;
+	int	n;
+
+	pthread_mutex_lock(&lock);
+	for ( t = 0; t < IdTables; t++ ) {
+		for ( n = 0; n < BUCKETS; n++ ) {
+			while ( tables[t][n] ) {
+				struct IdEntry *	e = tables[t][n];
+
+				tables[t][n] = e->next;
+				free(e);
+			}
+		}
+	}
+	pthread_mutex_unlock(&lock);
+}
@@ -6,33 +6,105 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/stat.h>
 
-struct FileInfo {
+/*
+ * Whether copying leaves holes in the destination: where the source has
+ * them, wherever a block is all zeros, or never.
+ */
+enum SparseMode {
+	SparseAuto = 0,
+	SparseAlways,
+	SparseNever
+};
+
+/*
+ * What the applet asked for. The applet's main function fills this in, and
+ * it is left alone once the tree walk starts; every FileInfo in the walk
+ * points to the same one.
+ */
+struct FileOptions {
 	unsigned int	complainInPostProcess:1;
 	unsigned int	changeUserID:1;
 	unsigned int	changeGroupID:1;
 	unsigned int	changeMode:1;
 	unsigned int	force:1;
 	unsigned int	recursive:1;
-	unsigned int	processDirectoriesAfterTheirContents;
+	unsigned int	processDirectoriesAfterTheirContents:1;
 	unsigned int	makeParentDirectories:1;
-	unsigned int	didOperation:1;
-	unsigned int	isSymbolicLink:1;
 	unsigned int	makeSymbolicLink:1;
 	unsigned int	dyadic:1;
-	const char *	source;
-	const char *	destination;
+	unsigned int	unsorted:1;
+	unsigned int	postProcessInFunction:1;
+	unsigned int	preserveAttributes:1;
+	unsigned int	preserveLinks:1;
+	unsigned int	atomicWrites:1;
+	unsigned int	syncWrites:1;
 	int				directoryLength;
+	int				threads;
+	enum SparseMode	sparse;
 	uid_t			userID;
 	gid_t			groupID;
 	mode_t			andWithMode;
 	mode_t			orWithMode;
-	struct stat		stat;
 	const struct Applet *
 					applet;
 };
 
+/*
+ * One of these describes each file the walker visits.
+ */
+struct FileInfo {
+	struct FileOptions *
+					options;
+	const char *	source;
+	const char *	destination;
+	int				directoryFd;		/* source is name within this */
+	const char *	name;
+	int				destinationFd;		/* destination is destinationName */
+	const char *	destinationName;	/* within this */
+	unsigned int	didOperation:1;
+	unsigned int	isSymbolicLink:1;
+	struct stat		stat;
+};
+
+/*
+ * A path that grows and shrinks in place as the walker goes down and
+ * back up the tree.
+ */
+struct PathBuffer {
+	char *			path;
+	int				length;
+	int				size;
+};
+
+struct DirectoryStream {
+	int				fd;
+	int				sorted;
+	int				error;
+	char *			buffer;
+	int				size;
+	int				length;
+	int				offset;
+	void * *		entries;
+	int				count;
+	int				next;
+	long long		position;	/* Of the descriptor, while it is closed */
+};
+
+/*
+ * How much of struct stat an applet's function looks at. When the file
+ * type is enough, the walker takes it from the directory entry and only
+ * calls stat() if the file system doesn't report it.
+ */
+enum StatNeeds {
+	NeedFullStat = 0,
+	NeedFileType
+};
+
 struct Applet {
 	const char *	name;
 	int				(*main)(struct FileInfo * i, int argc, char * * argv);
@@ -40,16 +112,139 @@ struct Applet {
 	const char *	usage;
 	int				minimumArgumentCount;
 	int				maximumArgumentCount;
+	enum StatNeeds	statNeeds;
 };
 
 extern void	name_and_error(const char *);
 extern int	is_a_directory(const char *);
 extern char *	join_paths(char *, const char *, const char *);
+extern int	path_append(struct PathBuffer * p, const char * name);
+extern void	path_truncate(struct PathBuffer * p, int length);
+
+/*
+ * Each directory being walked holds a descriptor, and so does its copy
+ * for dyadic applets. Below this depth the walkers work by path instead,
+ * so a deep tree doesn't run out of descriptors.
+ */
+#define	OPEN_DEPTH	64
 
 extern int	descend(
 		 struct FileInfo *o
 		,int 		(*function)(const struct FileInfo * i));
 
+extern int	stat_entry(
+		 int fd
+		,const char * name
+		,unsigned char type
+		,struct FileInfo * i);
+
+extern int	parallel_descend(
+		 struct FileInfo *o
+		,int 		(*function)(const struct FileInfo * i));
+
+extern int	open_directory(
+		 struct DirectoryStream * d
+		,int fd
+		,const char * name
+		,int sorted);
+extern const char *
+		read_directory(struct DirectoryStream * d, unsigned char * type);
+extern int	close_directory(struct DirectoryStream * d);
+extern int	suspend_directory(struct DirectoryStream * d);
+extern int	resume_directory(
+		 struct DirectoryStream * d
+		,int fd
+		,const char * name);
+
+extern char *	copy_buffer(void);
+extern long long	copy_data(int in, int out, long long length);
+extern int	copy_file(int in, int out, enum SparseMode sparse);
+extern long long	copy_sparse(
+		 int in
+		,int out
+		,long long length
+		,enum SparseMode sparse);
+extern long long	find_data(int fd, long long offset, long long * hole);
+extern long	write_sparse(int fd, const char * buffer, long length);
+extern long	pwrite_sparse(
+		 int fd
+		,const char * buffer
+		,long length
+		,long long offset);
+extern int	finish_sparse(int fd);
+extern int	parse_sparse(const char * s, enum SparseMode * sparse);
+extern int	skip_data(int fd, long long length);
+
+struct Pool;
+
+extern struct Pool *
+		pool_create(int threads, int maximumJobs, long long budget);
+extern int	pool_submit(
+		 struct Pool * p
+		,int (*run)(void * argument)
+		,void * argument
+		,long long bytes);
+extern int	pool_wait(struct Pool * p);
+extern int	pool_finish(struct Pool * p);
+
+struct HardLinks;
+
+extern struct HardLinks *
+		hard_links_create(void);
+extern const char *
+		hard_link_find(
+		 struct HardLinks * h
+		,const struct stat * s
+		,const char * name);
+extern const char *
+		hard_link_claim(
+		 struct HardLinks * h
+		,const struct stat * s
+		,const char * name);
+extern void	hard_link_done(
+		 struct HardLinks * h
+		,const struct stat * s
+		,int made);
+extern void	hard_links_free(struct HardLinks * h);
+
+/*
+ * What a copy has moved so far, for reports while it runs and at the end.
+ * The caller sets "records" to have the counts reported as dd's records,
+ * and "progress" to have the rate reported every second.
+ */
+struct TransferStats {
+	unsigned long long	bytes;
+	unsigned long long	fullIn;
+	unsigned long long	partialIn;
+	unsigned long long	fullOut;
+	unsigned long long	partialOut;
+	unsigned int	records:1;
+	unsigned int	progress:1;
+	struct timespec	start;
+	/* Kept by transfer_start() and transfer_finish() */
+	volatile int	stopping;
+	int				running;
+	int				printed;
+	pthread_t		reporter;
+	sigset_t		mask;
+};
+
+extern int	transfer_start(struct TransferStats * t);
+extern void	transfer_add(unsigned long long * counter, unsigned long long n);
+extern double	transfer_seconds(const struct TransferStats * t);
+extern void	transfer_report(struct TransferStats * t);
+extern void	transfer_finish(struct TransferStats * t);
+
+extern int	user_id(const char * name, uid_t * id);
+extern int	group_id(const char * name, gid_t * id);
+extern const char *	user_name(uid_t id);
+extern const char *	group_name(gid_t id);
+extern void	id_cache_free(void);
+
+extern int	batch_unlink(const struct FileInfo * i, int flags);
+extern int	batch_flush(void);
+extern int	batch_release(void);
+
 extern struct mntent *
 		findMountPoint(const char *, const char *);
 
@@ -59,12 +254,15 @@ extern void	usage(const char *);
 	extern int dinstall_main(void);
 #endif
 
+extern int bbbench_main(struct FileInfo * i, int argc, char * * argv);
 extern int block_device_main(struct FileInfo * i, int argc, char * * argv);
 extern int cat_more_main(struct FileInfo * i, int argc, char * * argv);
 extern int chgrp_main(struct FileInfo * i, int argc, char * * argv);
 extern int chmod_main(struct FileInfo * i, int argc, char * * argv);
 extern int chown_main(struct FileInfo * i, int argc, char * * argv);
 extern int clear_main(struct FileInfo * i, int argc, char * * argv);
+extern int cp_main(struct FileInfo * i, int argc, char * * argv);
+extern int ctar_main(struct FileInfo * i, int argc, char * * argv);
 extern int date_main(struct FileInfo * i, int argc, char * * argv);
 extern int dd_main(struct FileInfo * i, int argc, char * * argv);
 extern int df_main(struct FileInfo * i, int argc, char * * argv);
@@ -99,6 +297,7 @@ extern int star_main(struct FileInfo * i, int argc, char * * argv);
 extern int sync_main(struct FileInfo * i, int argc, char * * argv);
 extern int tarcat_main(struct FileInfo * i, int argc, char * * argv);
 extern int tput_main(struct FileInfo * i, int argc, char * * argv);
+extern int touch_main(struct FileInfo * i, int argc, char * * argv);
 extern int true_main(struct FileInfo * i, int argc, char * * argv);
 extern int tryopen_main(struct FileInfo * i, int argc, char * * argv);
 extern int umount_main(struct FileInfo * i, int argc, char * * argv);
@@ -116,6 +315,7 @@ extern int mkdir_fn(const struct FileInfo * i);
 extern int more_fn(const struct FileInfo * i);
 extern int mv_fn(const struct FileInfo * i);
 extern int post_process(const struct FileInfo * i);
+extern int post_process_fd(const struct FileInfo * i, int fd);
 extern int rm_fn(const struct FileInfo * i);
 extern int rmdir_fn(const struct FileInfo * i);
 extern int swapoff_fn(const struct FileInfo * i);
@@ -134,8 +334,12 @@ parse_mode(
 ,mode_t *		and
 ,int *			group_execute);
 
-extern int		parse_user_name(const char * string, struct FileInfo * i);
+extern const struct Applet *
+				find_applet(const char * name);
+
+extern int		parse_user_name(const char * string, struct FileOptions * o);
 
+extern const char	bbbench_usage[];
 extern const char	block_device_usage[];
 extern const char	cat_usage[];
 extern const char	chgrp_usage[];
@@ -143,6 +347,7 @@ extern const char	chmod_usage[];
 extern const char	chown_usage[];
 extern const char	clear_usage[];
 extern const char	cp_usage[];
+extern const char	ctar_usage[];
 extern const char	date_usage[];
 extern const char	dd_usage[];
 extern const char	df_usage[];
@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <sys/stat.h>
 #include <sys/param.h>
+#include <fcntl.h>
 #include <errno.h>
 
 const char	ln_usage[] = "ln [-s] [-f] original-name additional-name\n"
@@ -17,8 +18,10 @@ ln_fn(const struct FileInfo * i)
 	int				status = 0;
 	char			d[PATH_MAX];
 	const char *	destination = i->destination;
+	int				directoryFd = i->destinationFd;
+	const char *	name = i->destinationName;
 
-	if ( !i->makeSymbolicLink && (i->stat.st_mode & S_IFMT) == S_IFDIR ) {
+	if ( !i->options->makeSymbolicLink && (i->stat.st_mode & S_IFMT) == S_IFDIR ) {
 		fprintf(stderr, "Please use \"ln -s\" to link directories.\n");
 		return 1;
 	}
@@ -30,17 +33,19 @@ ln_fn(const struct FileInfo * i)
 			destination = join_paths(
 			 d
 			,i->destination
-			,&i->source[i->directoryLength]);
+			,&i->source[i->options->directoryLength]);
+			directoryFd = AT_FDCWD;
+			name = destination;
 	}
 
-	if ( i->force )
-		status = ( unlink(destination) && errno != ENOENT );
+	if ( i->options->force )
+		status = ( unlinkat(directoryFd, name, 0) && errno != ENOENT );
 
 	if ( status == 0 ) {
-		if ( i->makeSymbolicLink )
-			status = symlink(i->source, destination);
+		if ( i->options->makeSymbolicLink )
+			status = symlinkat(i->source, directoryFd, name);
 		else
-			status = link(i->source, destination);
+			status = linkat(i->directoryFd, i->name, directoryFd, name, 0);
 	}
 
 	if ( status != 0 ) {
@@ -67,10 +67,6 @@
 #include <dirent.h>
 #include <errno.h>
 #include <stdio.h>
-#ifdef FEATURE_USERNAME
-#include <pwd.h>
-#include <grp.h>
-#endif
 #ifdef FEATURE_TIMESTAMPS
 #include <time.h>
 #endif
@@ -238,9 +234,9 @@ static void list_single(const char *name, struct stat *info)
 		fputs(" ", stdout);
 #ifdef FEATURE_USERNAME
 		if (!(opts & DISP_NUMERIC)) {
-			struct passwd *pw = getpwuid(info->st_uid);
-			if (pw)
-				fputs(pw->pw_name, stdout);
+			const char *name = user_name(info->st_uid);
+			if (name)
+				fputs(name, stdout);
 			else
 				writenum((long)info->st_uid,(short)0);
 		} else
@@ -249,9 +245,9 @@ static void list_single(const char *name, struct stat *info)
 		tab(24);
 #ifdef FEATURE_USERNAME
 		if (!(opts & DISP_NUMERIC)) {
-			struct group *gr = getgrgid(info->st_gid);
-			if (gr)
-				fputs(gr->gr_name, stdout);
+			const char *name = group_name(info->st_gid);
+			if (name)
+				fputs(name, stdout);
 			else
 				writenum((long)info->st_gid,(short)0);
 		} else
@@ -2,9 +2,18 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
 
+/*
+ * Kept in strcmp() order, so that we can find the applet with bsearch().
+ * The Makefile checks the order. An applet that appears under two names
+ * gets an #ifdef block for each.
+ */
 static const struct Applet	applets[] = {
 
+#ifdef BB_BENCH	//usr/bin
+{ "bbbench",	bbbench_main, 0, bbbench_usage,			0, -1 },
+#endif
 #ifdef BB_BLOCK_DEVICE	//sbin
 { "block_device", block_device_main, 0, block_device_usage,	1, 1 },
 #endif
@@ -24,13 +33,16 @@ static const struct Applet	applets[] = {
 { "clear",	clear_main, 0, clear_usage,			0, 0 },
 #endif
 #ifdef BB_CP	//bin
-{ "cp",		dyadic_main, cp_fn, cp_usage,			2, -1 },
+{ "cp",		cp_main, cp_fn, cp_usage,			2, -1 },
+#endif
+#ifdef BB_CTAR	//bin
+{ "ctar",	ctar_main, 0, ctar_usage,			1, -1 },
 #endif
 #ifdef BB_DATE	//bin
 { "date",	date_main, 0, date_usage,			0, 1 },
 #endif
 #ifdef BB_DD	//bin
-{ "dd",		dd_main, 0, dd_usage,				0, 2 },
+{ "dd",		dd_main, 0, dd_usage,				0, -1 },
 #endif
 #ifdef BB_DF	//bin
 { "df",		df_main, 0, df_usage,				0, -1 },
@@ -48,7 +60,13 @@ static const struct Applet	applets[] = {
 { "fdflush",	monadic_main, fdflush_fn, fdflush_usage,	1, -1 },
 #endif
 #ifdef BB_FIND	//usr/bin
-{ "find",	find_main, find_fn, find_usage,			1, -1 },
+{ "find",	find_main, find_fn, find_usage,			1, -1, NeedFileType },
+#endif
+#ifdef BB_ZCAT	//bin
+{ "gunzip",	zcat_main, 0, zcat_usage,			0, -1 },
+#endif
+#ifdef BB_GZIP	//bin
+{ "gzip",	gzip_main, 0, gzip_usage,			0, 0 },
 #endif
 #ifdef BB_HALT	//sbin
 { "halt",	halt_main, 0, halt_usage,			0, 0 },
@@ -111,7 +129,7 @@ static const struct Applet	applets[] = {
 { "reboot",	reboot_main, 0, reboot_usage,			0, 0 },
 #endif
 #ifdef BB_RM	//bin
-{ "rm",		rm_main, rm_fn, rm_usage,			1, -1 },
+{ "rm",		rm_main, rm_fn, rm_usage,			1, -1, NeedFileType },
 #endif
 #ifdef BB_RMDIR	//bin
 { "rmdir",	monadic_main, rmdir_fn, rmdir_usage,		1, -1 },
@@ -121,7 +139,6 @@ static const struct Applet	applets[] = {
 #endif
 #ifdef BB_STAR	//bin
 { "star",	star_main, 0, star_usage,			0, 0 },
-{ "untar",	star_main, 0, star_usage,			0, 0 },
 #endif
 #ifdef BB_SWAPOFF	//sbin
 { "swapoff",	monadic_main, swapoff_fn, swapoff_usage,	1, -1 },
@@ -133,10 +150,10 @@ static const struct Applet	applets[] = {
 { "sync",	sync_main, 0, sync_usage,			0, 0 },
 #endif
 #ifdef BB_TARCAT	//bin
-{ "tarcat",	tarcat_main, 0, tarcat_usage,			1, 1 },
+{ "tarcat",	tarcat_main, 0, tarcat_usage,			1, -1 },
 #endif
 #ifdef BB_TOUCH	//usr/bin
-{ "touch",	monadic_main, touch_fn, touch_usage,		1, -1 },
+{ "touch",	touch_main, touch_fn, touch_usage,		1, -1, NeedFileType },
 #endif
 #ifdef BB_TRUE	//bin
 { "true",	true_main, 0, true_usage,			0, 0 },
@@ -144,25 +161,41 @@ static const struct Applet	applets[] = {
 #ifdef BB_UMOUNT	//bin
 { "umount",	umount_main, 0, umount_usage,			1, -1 },
 #endif
+#ifdef BB_STAR	//bin
+{ "untar",	star_main, 0, star_usage,			0, 0 },
+#endif
 #ifdef BB_UPDATE	//sbin
 { "update",	update_main, 0, update_usage,			0, -1 },
 #endif
 #ifdef BB_ZCAT	//bin
 { "zcat",	zcat_main, 0, zcat_usage,			0, -1 },
-{ "gunzip",	zcat_main, 0, zcat_usage,			0, -1 },
-#endif
-#ifdef BB_GZIP	//bin
-{ "gzip",	gzip_main, 0, gzip_usage,			0, 0 },
 #endif
-{ 0 }
 };
 
+static int
+compare_applet(const void * name, const void * applet)
+{
+	return strcmp((const char *)name, ((const struct Applet *)applet)->name);
+}
+
+extern const struct Applet *
+find_applet(const char * name)
+{
+	return bsearch(
+	 name
+	,applets
+	,sizeof(applets) / sizeof(applets[0])
+	,sizeof(applets[0])
+	,compare_applet);
+}
+
 extern int
 main(int argc, char * * argv)
 {
 	char * s = argv[0];
 	char * name = argv[0];
-	const struct Applet * a = applets;
+	const struct Applet * a;
+	struct FileOptions	o;
 	struct FileInfo	i;
 
 	while ( *s != '\0' ) {
@@ -179,34 +212,34 @@ main(int argc, char * * argv)
 	}
 #endif
 
-	while ( a->name != 0 ) {
-		if ( strcmp(name, a->name) == 0 ) {
-			int	status;
+	if ( (a = find_applet(name)) != 0 ) {
+		int	status;
 
-			if ( argc - 1 < a->minimumArgumentCount
-			 || (a->maximumArgumentCount > 0
-			  && argc - 1 > a->maximumArgumentCount )
-			 || (a->usage && argc >= 2 && strcmp(argv[1], "--help") == 0 ) ) {
-				usage(a->usage);
-				return 1;
-			}
-			errno = 0;
-			memset((void *)&i, 0, sizeof(struct FileInfo));
-			i.orWithMode = 0777;
-			i.andWithMode = ~0;
-			i.applet = a;
-			status = ((*(a->main))(&i, argc, argv));
-			if ( status < 0 ) {
-				fprintf( stderr,"%s: %s\n"
-				,a->name ,strerror(errno));
-			}
-			exit(status);
+		if ( argc - 1 < a->minimumArgumentCount
+		 || (a->maximumArgumentCount > 0
+		  && argc - 1 > a->maximumArgumentCount )
+		 || (a->usage && argc >= 2 && strcmp(argv[1], "--help") == 0 ) ) {
+			usage(a->usage);
+			return 1;
+		}
+		errno = 0;
+		memset((void *)&o, 0, sizeof(struct FileOptions));
+		memset((void *)&i, 0, sizeof(struct FileInfo));
+		o.orWithMode = 0777;
+		o.andWithMode = ~0;
+		o.applet = a;
+		i.options = &o;
+		i.directoryFd = AT_FDCWD;
+		i.destinationFd = AT_FDCWD;
+		status = ((*(a->main))(&i, argc, argv));
+		if ( status < 0 ) {
+			fprintf( stderr,"%s: %s\n"
+			,a->name ,strerror(errno));
 		}
-		a++;
+		exit(status);
 	}
 	fprintf(stderr, "BusyBox v%s (%s) multi-call binary -- GPL2\n"
 			"\tError: called as %s. No function defined for that.\n",
 			BB_VER, BB_BT, argv[0]);
 	return -1;
 }
-
@@ -1,4 +1,6 @@
 #include "internal.h"
+#include <stdio.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <sys/param.h>
 
@@ -8,42 +10,82 @@ const char mkdir_usage[] = "mkdir [-m mode] directory [directory ...]\n"
 "\t-m mode:\tSpecifiy the mode for the new directory\n"
 "\t\tunder the argument directory.";
 
-int
-mkdir_fn(const struct FileInfo * i)
+/*
+ * Make each leading directory of the path in turn, holding the one above
+ * open so that each step is a single lookup.
+ */
+static int
+make_parents(const struct FileInfo * i, int * parentFd, const char * * name)
 {
-	if ( i->makeParentDirectories ) {
+	char *	path = strdup(i->source);
+	char *	component = path;
+	char *	s;
+	int		fd = AT_FDCWD;
+	int		length = strlen(path);
+
+	while ( length > 1 && path[length - 1] == '/' )
+		path[--length] = '\0';
+
+	if ( *component == '/' ) {
+		fd = open("/", O_RDONLY|O_DIRECTORY);
+		while ( *component == '/' )
+			component++;
+	}
 
-		char	path[PATH_MAX];
-		char *	s = path;
+	while ( fd != -1 && (s = strchr(component, '/')) != 0 ) {
+		int	next;
 
-		strcpy(path, i->source);
+		*s = '\0';
+		if ( *component != '\0'
+		 && mkdirat(fd, component, i->options->orWithMode) != 0
+		 && errno != EEXIST ) {
+			name_and_error(i->source);
+			break;
+		}
+		next = *component ? openat(fd, component, O_RDONLY|O_DIRECTORY) : dup(fd);
+		if ( fd >= 0 )
+			close(fd);
+		if ( (fd = next) < 0 ) {
+			name_and_error(i->source);
+			fd = -1;
+		}
+		component = s + 1;
+	}
 
-		if ( s[0] == '\0' && s[1] == '\0' ) {
+	if ( fd == -1 || s != 0 ) {
+		if ( fd >= 0 )
+			close(fd);
+		free(path);
+		return 1;
+	}
+	*parentFd = fd;
+	/* "/" has no last component; it names the directory we have open. */
+	*name = *component ? &i->source[component - path] : ".";
+	free(path);
+	return 0;
+}
+
+int
+mkdir_fn(const struct FileInfo * i)
+{
+	int				fd = i->directoryFd;
+	const char *	name = i->name;
+	int				status;
+
+	if ( i->options->makeParentDirectories ) {
+		if ( i->source[0] == '\0' ) {
 			usage(mkdir_usage);
 			return 1;
 		}
-		s++;
-		while ( *s != '\0' ) {
-			if ( *s == '/' ) {
-				int	status;
-
-				*s = '\0';
-				status = mkdir(path, i->orWithMode);
-				*s = '/';
-
-				if ( status != 0 ) {
-					if ( errno != EEXIST ) {
-						name_and_error(i->source);
-						return 1;
-					}
-				}
-
-			}
-			s++;
-		}
+		if ( make_parents(i, &fd, &name) != 0 )
+			return 1;
 	}
 
-	if ( mkdir(i->source, i->orWithMode) != 0 && errno != EEXIST ) {
+	status = mkdirat(fd, name, i->options->orWithMode);
+	if ( fd >= 0 && fd != i->directoryFd )
+		close(fd);
+
+	if ( status != 0 && errno != EEXIST ) {
 		name_and_error(i->source);
 		return 1;
 	}
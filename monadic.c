@@ -2,6 +2,9 @@
 #include <stdio.h>
 #include <string.h>
 #include <grp.h>
+#include <sys/param.h>
+#include <fcntl.h>
+#include <dirent.h>
 
 extern int
 monadic_main(
@@ -9,12 +12,15 @@ monadic_main(
 ,int				argc
 ,char * *			argv)
 {
-	int	status = 0;
+	struct FileOptions *	o = i->options;
+	int				status = 0;
+	const char *	destination = i->destination;
+	char			d[PATH_MAX];
 
 	while ( argc > 1 && argv[1][0] == '-' ) {
 		switch ( argv[1][1] ) {
 		case 'f':
-			i->force = 1;
+			o->force = 1;
 			break;
 		case 'g':
 			if ( argc > 2 ) {
@@ -23,58 +29,71 @@ monadic_main(
 					fprintf(stderr, "%s: no such group.\n", argv[1]);
 					return 1;
 				}
-				i->groupID = g->gr_gid;
-				i->changeGroupID = 1;
-				i->complainInPostProcess = 1;
+				o->groupID = g->gr_gid;
+				o->changeGroupID = 1;
+				o->complainInPostProcess = 1;
 				argc--;
 				argv++;
 				break;
 			}
-			usage(i->applet->usage);
+			usage(o->applet->usage);
+			return 1;
+		case 'j':
+			if ( argv[1][2] != '\0' ) {
+				o->threads = atoi(&argv[1][2]);
+				break;
+			}
+			if ( argc > 2 ) {
+				o->threads = atoi(argv[2]);
+				argc--;
+				argv++;
+				break;
+			}
+			usage(o->applet->usage);
 			return 1;
 		case 'm':
 			if ( argc > 2 ) {
 				status = parse_mode(
 				 argv[2]
-				,&i->orWithMode
-				,&i->andWithMode, 0);
+				,&o->orWithMode
+				,&o->andWithMode, 0);
 
 				if ( status == 0 ) {
-					i->changeMode = 1;
-					i->complainInPostProcess = 1;
+					o->changeMode = 1;
+					o->complainInPostProcess = 1;
 					argc--;
 					argv++;
 					break;
 				}
 			}
-			usage(i->applet->usage);
+			usage(o->applet->usage);
 			return 1;
 		case 'o':
 			if ( argc > 2 ) {
-				status = parse_user_name(argv[2], i);
+				status = parse_user_name(argv[2], o);
 				if ( status != 0 )
 					return status;
 
-				i->changeUserID = 1;
-				i->complainInPostProcess = 1;
+				o->changeUserID = 1;
+				o->complainInPostProcess = 1;
 				argc--;
 				argv++;
 				break;
 			}
-			usage(i->applet->usage);
+			usage(o->applet->usage);
 			return 1;
 		case 'p':
-			i->makeParentDirectories = 1;
+			o->makeParentDirectories = 1;
 			break;
 		case 'r':
 		case 'R':
-			i->recursive = 1;
+			o->recursive = 1;
 			break;
 		case 's':
-			i->makeSymbolicLink = 1;
+			o->makeSymbolicLink = 1;
 			break;
 		default:
-			usage(i->applet->usage);
+			usage(o->applet->usage);
 			return 1;
 		}
 		argv++;
@@ -84,37 +103,58 @@ monadic_main(
 		char *	slash;
 		i->source = argv[1];
 		if ( (slash = strrchr(i->source, '/')) != 0 ) {
-			i->directoryLength = slash - i->source;
-			if ( i->source[i->directoryLength] == '\0' )
-				i->directoryLength = 0;
+			o->directoryLength = slash - i->source;
+			if ( i->source[o->directoryLength] == '\0' )
+				o->directoryLength = 0;
 		}
 		else
-			i->directoryLength = 0;
-		if ( !i->dyadic )
+			o->directoryLength = 0;
+		if ( !o->dyadic )
 			i->destination = i->source;
-
-		if ( lstat(i->source, &i->stat) == 0 ) {
-			i->isSymbolicLink = (i->stat.st_mode & S_IFMT)==S_IFLNK;
-			if ( i->isSymbolicLink )
-				if ( stat(i->source, &i->stat) != 0 )
-					memset(&i->stat, 0, sizeof(i->stat));
-		}
 		else
+			i->destination = destination;
+		i->directoryFd = AT_FDCWD;
+		i->name = i->source;
+		i->destinationFd = AT_FDCWD;
+		i->destinationName = i->destination;
+
+		if ( stat_entry(AT_FDCWD, i->source, DT_UNKNOWN, i) != 0 ) {
 			memset(&i->stat, 0, sizeof(i->stat));
+			i->isSymbolicLink = 0;
+		}
+
+		/*
+		 * "cp -r dir existing-directory" copies into a new directory
+		 * within the destination.
+		 */
+		if ( o->dyadic
+		 && o->recursive
+		 && !i->isSymbolicLink
+		 && (i->stat.st_mode & S_IFMT) == S_IFDIR
+		 && is_a_directory(destination) ) {
+			i->destination = join_paths(
+			 d
+			,destination
+			,&i->source[o->directoryLength]);
+			i->destinationName = i->destination;
+		}
 
 		if ( i->isSymbolicLink
-		 || !i->recursive
+		 || !o->recursive
 		 || ((i->stat.st_mode & S_IFMT) != S_IFDIR) ) {
 
-			if ( i->applet->function )
-				status = i->applet->function(i);
+			if ( o->applet->function )
+				status = o->applet->function(i);
 			if ( status == 0 )
 				status = post_process(i);
 		}
 		else
-			status = descend(i, i->applet->function);
+			status = descend(i, o->applet->function);
+
+		if ( batch_flush() != 0 && status == 0 )
+			status = 1;
 
-		if ( status != 0 && !i->force )
+		if ( status != 0 && !o->force )
 			return status;
 		argv++;
 		argc--;
@@ -1,11 +1,13 @@
 #include "internal.h"
 #include <stdio.h>
+#include <fcntl.h>
 #include <errno.h>
 
 const char	mv_usage[] = "mv source-file destination-file\n"
 "\t\tmv source-file [source-file ...] destination-directory\n"
 "\n"
 "\tMove the source files to the destination.\n"
+"\tFiles are moved one at a time; -j is ignored.\n"
 "\n";
 
 extern int
@@ -15,17 +17,29 @@ mv_fn(const struct FileInfo * i)
 	char			d[1024];
 	struct FileInfo	n;
 
-	if ( stat(i->destination, &destination_stat) == 0 ) {
+	if ( fstatat(
+	 i->destinationFd
+	,i->destinationName
+	,&destination_stat
+	,0) == 0 ) {
 		if ( i->stat.st_ino == destination_stat.st_ino
 		 &&  i->stat.st_dev == destination_stat.st_dev )
 			return 0;	/* Move file to itself. */
 	}
+	else
+		destination_stat.st_mode = 0;
 	if ( (destination_stat.st_mode & S_IFMT) == S_IFDIR ) {
 		n = *i;
 		n.destination = join_paths(d, i->destination, basename(i->source));
+		n.destinationFd = AT_FDCWD;
+		n.destinationName = n.destination;
 		i = &n;
 	}
-	if ( rename(i->source, i->destination) == 0 )
+	if ( renameat(
+	 i->directoryFd
+	,i->name
+	,i->destinationFd
+	,i->destinationName) == 0 )
 		return 0;
 	else if ( errno == EXDEV && is_a_directory(i->source) ) {
 		fprintf(stderr
@@ -33,6 +47,51 @@ mv_fn(const struct FileInfo * i)
 		,i->source);
 		return 1;
 	}
-	else
-		return cp_fn(i);
+	else {
+		/*
+		 * Across file systems, copy the file with its attributes, and
+		 * only give the copy its name once it is complete. Then the
+		 * original can go. The copy is made here, not on cp's pool,
+		 * and is looked for under its name before the original is
+		 * removed, so that there is never a moment with neither.
+		 */
+		struct FileOptions	o = *i->options;
+		struct stat			copy_stat;
+
+		if ( i != &n ) {
+			n = *i;
+			i = &n;
+		}
+		o.preserveAttributes = 1;
+		o.preserveLinks = 1;
+		o.atomicWrites = 1;
+		o.threads = 0;
+		n.options = &o;
+		if ( cp_fn(i) != 0 )
+			return 1;
+		if ( fstatat(
+		 i->destinationFd
+		,i->destinationName
+		,&copy_stat
+		,AT_SYMLINK_NOFOLLOW) != 0 ) {
+			name_and_error(i->destination);
+			return 1;
+		}
+		if ( i->isSymbolicLink
+		 ? !S_ISLNK(copy_stat.st_mode)
+		 : ((copy_stat.st_mode & S_IFMT) != (i->stat.st_mode & S_IFMT)
+		  || (S_ISREG(i->stat.st_mode)
+		   && copy_stat.st_size != i->stat.st_size)) ) {
+			fprintf(stderr
+			,"%s: The copy is incomplete; not removing %s.\n"
+			,i->destination
+			,i->source);
+			return 1;
+		}
+		if ( unlinkat(i->directoryFd, i->name, 0) != 0 ) {
+			name_and_error(i->source);
+			return 1;
+		}
+		return 0;
+	}
 }
@@ -0,0 +1,457 @@
+#include "internal.h"
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+
+/*
+ * A parallel descend(). Every worker thread owns a deque of directories
+ * that are waiting to be read. A worker takes work from the bottom of its
+ * own deque, and when that is empty it steals from the top of somebody
+ * else's. Files are handled by the thread that reads their directory;
+ * subdirectories become new tasks.
+ *
+ * Each task counts itself plus its unfinished subdirectories in "pending".
+ * The last one to finish runs the directory's callback when we are
+ * processing directories after their contents, so "rm -r" still removes
+ * a directory only once it is empty. A task keeps its directory open
+ * until then, and its children work relative to that descriptor. Below
+ * OPEN_DEPTH, a task closes its directory once it has been read, and its
+ * children work by path.
+ */
+
+#define	MAXIMUM_THREADS	64
+
+struct Task {
+	struct Task *	parent;
+	char *			source;
+	char *			name;
+	char *			destination;
+	struct stat		stat;
+	int				isSymbolicLink;
+	int				fd;
+	int				destinationFd;
+	int				depth;
+	int				pending;
+};
+
+struct Deque {
+	pthread_mutex_t	lock;
+	struct Task * *	tasks;
+	int				top;
+	int				bottom;
+	int				size;
+};
+
+struct Walker {
+	const struct FileInfo *	info;
+	int				(*function)(const struct FileInfo * i);
+	int				threads;
+	struct Deque	deques[MAXIMUM_THREADS];
+	pthread_mutex_t	lock;
+	pthread_cond_t	wake;
+	int				queued;
+	int				idle;
+	int				done;
+	int				abort;
+	int				status;
+};
+
+struct Worker {
+	struct Walker *	walker;
+	int				index;
+	struct PathBuffer	path;
+	struct PathBuffer	destination;
+};
+
+static void
+push(struct Walker * w, int index, struct Task * t)
+{
+	struct Deque *	q = &w->deques[index];
+
+	pthread_mutex_lock(&q->lock);
+	if ( q->bottom == q->size ) {
+		if ( q->top > 0 ) {
+			memmove(q->tasks, &q->tasks[q->top]
+			 ,(q->bottom - q->top) * sizeof(*q->tasks));
+			q->bottom -= q->top;
+			q->top = 0;
+		}
+		else {
+			q->size = q->size ? q->size * 2 : 64;
+			q->tasks = realloc(q->tasks, q->size * sizeof(*q->tasks));
+		}
+	}
+	q->tasks[q->bottom++] = t;
+	pthread_mutex_unlock(&q->lock);
+
+	pthread_mutex_lock(&w->lock);
+	w->queued++;
+	if ( w->idle > 0 )
+		pthread_cond_signal(&w->wake);
+	pthread_mutex_unlock(&w->lock);
+}
+
+static struct Task *
+take(struct Walker * w, int index)
+{
+	struct Task *	t = 0;
+	int				n;
+
+	for ( n = 0; n < w->threads && t == 0; n++ ) {
+		struct Deque *	q = &w->deques[(index + n) % w->threads];
+
+		pthread_mutex_lock(&q->lock);
+		if ( q->bottom > q->top ) {
+			if ( n == 0 )
+				t = q->tasks[--q->bottom];	/* Our own, newest first */
+			else
+				t = q->tasks[q->top++];		/* Steal the oldest */
+			if ( q->top == q->bottom )
+				q->top = q->bottom = 0;
+		}
+		pthread_mutex_unlock(&q->lock);
+	}
+	return t;
+}
+
+static struct Task *
+next_task(struct Walker * w, int index)
+{
+	for ( ; ; ) {
+		struct Task *	t = take(w, index);
+
+		pthread_mutex_lock(&w->lock);
+		if ( t ) {
+			w->queued--;
+			pthread_mutex_unlock(&w->lock);
+			return t;
+		}
+		while ( w->queued <= 0 && !w->done ) {
+			w->idle++;
+			pthread_cond_wait(&w->wake, &w->lock);
+			w->idle--;
+		}
+		if ( w->done ) {
+			pthread_mutex_unlock(&w->lock);
+			return 0;
+		}
+		pthread_mutex_unlock(&w->lock);
+	}
+}
+
+static void
+fail(struct Walker * w, int status)
+{
+	pthread_mutex_lock(&w->lock);
+	if ( w->status == 0 )
+		w->status = status;
+	if ( !w->info->options->force )
+		__atomic_store_n(&w->abort, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&w->lock);
+}
+
+/*
+ * "abort" is set under the lock, but read without it while walking.
+ */
+static int
+aborted(struct Walker * w)
+{
+	return __atomic_load_n(&w->abort, __ATOMIC_ACQUIRE);
+}
+
+static int
+visit(struct Walker * w, const struct FileInfo * i)
+{
+	int	status = 0;
+
+	if ( w->function )
+		status = (*w->function)(i);
+	if ( status == 0 )
+		status = post_process(i);
+	if ( status != 0 )
+		fail(w, status);
+	return status;
+}
+
+static void
+task_info(struct Walker * w, struct Task * t, struct FileInfo * i)
+{
+	struct Task *	parent = t->parent;
+
+	*i = *w->info;
+	i->source = t->source;
+	i->stat = t->stat;
+	i->isSymbolicLink = t->isSymbolicLink;
+	if ( parent == 0 )
+		return;
+
+	/*
+	 * Whether to use the parent's descriptors depends only on its depth,
+	 * since a deep parent may close them while we are still using them.
+	 */
+	if ( parent->depth < OPEN_DEPTH ) {
+		i->directoryFd = parent->fd;
+		i->name = t->name;
+	}
+	else {
+		i->directoryFd = AT_FDCWD;
+		i->name = t->source;
+	}
+	if ( i->options->dyadic ) {
+		i->destination = t->destination;
+		if ( parent->depth < OPEN_DEPTH && parent->destinationFd >= 0 ) {
+			i->destinationFd = parent->destinationFd;
+			i->destinationName = t->name;
+		}
+		else {
+			i->destinationFd = AT_FDCWD;
+			i->destinationName = t->destination;
+		}
+	}
+	else {
+		i->destination = i->source;
+		i->destinationFd = i->directoryFd;
+		i->destinationName = i->name;
+	}
+}
+
+static void
+finish(struct Walker * w, struct Task * t)
+{
+	while ( __sync_sub_and_fetch(&t->pending, 1) == 0 ) {
+		struct Task *	parent = t->parent;
+
+		if ( w->info->options->processDirectoriesAfterTheirContents
+		 && !aborted(w) ) {
+			struct FileInfo	i;
+
+			task_info(w, t, &i);
+			visit(w, &i);
+		}
+		if ( batch_flush() != 0 )
+			fail(w, 1);
+		if ( t->fd >= 0 )
+			close(t->fd);
+		if ( t->destinationFd >= 0 )
+			close(t->destinationFd);
+		free(t->source);
+		free(t->name);
+		free(t->destination);
+		free(t);
+
+		if ( parent == 0 ) {
+			pthread_mutex_lock(&w->lock);
+			w->done = 1;
+			pthread_cond_broadcast(&w->wake);
+			pthread_mutex_unlock(&w->lock);
+			return;
+		}
+		t = parent;
+	}
+}
+
+static void
+scan(struct Worker * k, struct Task * t)
+{
+	struct Walker *	w = k->walker;
+	const struct FileOptions *	o = w->info->options;
+	struct FileInfo	i;
+	struct DirectoryStream	directory;
+	const char *	name;
+	unsigned char	type;
+
+	task_info(w, t, &i);
+
+	if ( !o->processDirectoriesAfterTheirContents && !aborted(w) )
+		visit(w, &i);
+
+	if ( aborted(w) ) {
+		finish(w, t);
+		return;
+	}
+
+	if ( open_directory(&directory, i.directoryFd, i.name, !o->unsorted) != 0 ) {
+		name_and_error(t->source);
+		fail(w, 1);
+		finish(w, t);
+		return;
+	}
+	t->fd = directory.fd;
+
+	if ( o->dyadic )
+		t->destinationFd = openat(
+		 i.destinationFd
+		,i.destinationName
+		,O_RDONLY|O_DIRECTORY);
+
+	k->path.length = 0;
+	path_append(&k->path, t->source);
+	if ( o->dyadic ) {
+		k->destination.length = 0;
+		path_append(&k->destination, i.destination);
+	}
+
+	while ( !aborted(w) && (name = read_directory(&directory, &type)) != 0 ) {
+		struct FileInfo	c = i;
+		int				length = strlen(name);
+		int				sourceLength = path_append(&k->path, name);
+		int				destinationLength = 0;
+
+		c.source = k->path.path;
+		c.directoryFd = t->fd;
+		c.name = &k->path.path[k->path.length - length];
+		if ( o->dyadic ) {
+			destinationLength = path_append(&k->destination, name);
+			c.destination = k->destination.path;
+			if ( t->destinationFd >= 0 ) {
+				c.destinationFd = t->destinationFd;
+				c.destinationName = &c.destination[k->destination.length - length];
+			}
+			else {
+				c.destinationFd = AT_FDCWD;
+				c.destinationName = c.destination;
+			}
+		}
+		else {
+			c.destination = c.source;
+			c.destinationFd = c.directoryFd;
+			c.destinationName = c.name;
+		}
+
+		if ( stat_entry(t->fd, name, type, &c) != 0 ) {
+			if ( errno != ENOENT ) {
+				fprintf(stderr, "Can't stat %s: %s\n", c.source, strerror(errno));
+				fail(w, 1);
+			}
+		}
+		else if ( !c.isSymbolicLink && (c.stat.st_mode & S_IFMT) == S_IFDIR ) {
+			struct Task *	child = malloc(sizeof(*child));
+
+			child->parent = t;
+			child->source = strdup(c.source);
+			child->name = strdup(name);
+			child->destination = o->dyadic ? strdup(c.destination) : 0;
+			child->stat = c.stat;
+			child->isSymbolicLink = 0;
+			child->fd = -1;
+			child->destinationFd = -1;
+			child->depth = t->depth + 1;
+			child->pending = 1;
+			__sync_add_and_fetch(&t->pending, 1);
+			push(w, k->index, child);
+		}
+		else
+			visit(w, &c);
+
+		path_truncate(&k->path, sourceLength);
+		if ( o->dyadic )
+			path_truncate(&k->destination, destinationLength);
+	}
+	if ( directory.error != 0 ) {
+		errno = directory.error;
+		name_and_error(t->source);
+		fail(w, 1);
+	}
+	directory.fd = -1;		/* The task closes it when it finishes */
+	close_directory(&directory);
+
+	/* Queued operations refer to t->fd, which may be closed by another thread. */
+	if ( batch_flush() != 0 )
+		fail(w, 1);
+	if ( t->depth >= OPEN_DEPTH ) {
+		close(t->fd);
+		t->fd = -1;
+		if ( t->destinationFd >= 0 )
+			close(t->destinationFd);
+		t->destinationFd = -1;
+	}
+	finish(w, t);
+}
+
+static void *
+work(void * argument)
+{
+	struct Worker *	k = (struct Worker *)argument;
+	struct Task *	t;
+
+	while ( (t = next_task(k->walker, k->index)) != 0 )
+		scan(k, t);
+
+	if ( batch_release() != 0 )
+		fail(k->walker, 1);
+	free(k->path.path);
+	free(k->destination.path);
+	return 0;
+}
+
+extern int
+parallel_descend(
+ struct FileInfo *info
+,int 		(*function)(const struct FileInfo * i))
+{
+	struct Walker	w;
+	struct Worker	workers[MAXIMUM_THREADS];
+	pthread_t		threads[MAXIMUM_THREADS];
+	struct Task *	root;
+	int				n;
+
+	if ( *info->source == '\0' ) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if ( info->stat.st_dev == 0
+	 && info->stat.st_ino == 0
+	 && info->stat.st_mode == 0 ) {
+		if ( stat_entry(info->directoryFd, info->name, DT_UNKNOWN, info) != 0 )
+			return -1;
+	}
+
+	memset(&w, 0, sizeof(w));
+	w.info = info;
+	w.function = function;
+	w.threads = info->options->threads;
+	if ( w.threads > MAXIMUM_THREADS )
+		w.threads = MAXIMUM_THREADS;
+	pthread_mutex_init(&w.lock, 0);
+	pthread_cond_init(&w.wake, 0);
+	for ( n = 0; n < w.threads; n++ ) {
+		pthread_mutex_init(&w.deques[n].lock, 0);
+		memset(&workers[n], 0, sizeof(workers[n]));
+		workers[n].walker = &w;
+		workers[n].index = n;
+	}
+
+	root = malloc(sizeof(*root));
+	root->parent = 0;
+	root->source = strdup(info->source);
+	root->name = 0;
+	root->destination = 0;
+	root->stat = info->stat;
+	root->isSymbolicLink = info->isSymbolicLink;
+	root->fd = -1;
+	root->destinationFd = -1;
+	root->depth = 0;
+	root->pending = 1;
+	push(&w, 0, root);
+
+	for ( n = 1; n < w.threads; n++ ) {
+		if ( pthread_create(&threads[n], 0, work, &workers[n]) != 0 )
+			break;
+	}
+	work(&workers[0]);
+	while ( --n > 0 )
+		pthread_join(threads[n], 0);
+
+	for ( n = 0; n < w.threads; n++ ) {
+		pthread_mutex_destroy(&w.deques[n].lock);
+		free(w.deques[n].tasks);
+	}
+	pthread_mutex_destroy(&w.lock);
+	pthread_cond_destroy(&w.wake);
+
+	return w.status;
+}
@@ -0,0 +1,180 @@
+#include "internal.h"
+#include <pthread.h>
+
+/*
+ * A pool of threads that run jobs from a bounded queue. pool_submit()
+ * waits while the queue is full, or while the bytes that the queued and
+ * running jobs will move would go over the budget, so that whatever feeds
+ * the pool can't get far ahead of the I/O. A job that is bigger than the
+ * whole budget still runs, once everything before it has finished.
+ *
+ * A job returns 0, or a status for the pool to keep. pool_finish() waits
+ * for all of the jobs and returns the first status that wasn't 0.
+ */
+
+#define	MAXIMUM_THREADS	64
+
+struct Job {
+	struct Job *	next;
+	int				(*run)(void * argument);
+	void *			argument;
+	long long		bytes;
+};
+
+struct Pool {
+	pthread_mutex_t	lock;
+	pthread_cond_t	ready;		/* A job was queued, or we are closing */
+	pthread_cond_t	space;		/* A job finished */
+	struct Job *	first;
+	struct Job *	last;
+	int				jobs;		/* Queued and running */
+	int				maximumJobs;
+	long long		bytes;		/* Of the queued and running jobs */
+	long long		budget;
+	int				closing;
+	int				status;
+	int				threads;
+	pthread_t		thread[MAXIMUM_THREADS];
+};
+
+static void *
+work(void * argument)
+{
+	struct Pool *	p = (struct Pool *)argument;
+
+	pthread_mutex_lock(&p->lock);
+	for ( ; ; ) {
+		struct Job *	j;
+		int				status;
+
+		while ( p->first == 0 && !p->closing )
+			pthread_cond_wait(&p->ready, &p->lock);
+		if ( (j = p->first) == 0 )
+			break;
+		if ( (p->first = j->next) == 0 )
+			p->last = 0;
+		pthread_mutex_unlock(&p->lock);
+
+		status = (*j->run)(j->argument);
+
+		pthread_mutex_lock(&p->lock);
+		if ( status != 0 && p->status == 0 )
+			p->status = status;
+		p->jobs--;
+		p->bytes -= j->bytes;
+		pthread_cond_broadcast(&p->space);
+		free(j);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return 0;
+}
+
+/*
+ * Returns 0 if not even one thread could be started, in which case the
+ * caller should do the work itself.
+ */
+extern struct Pool *
+pool_create(int threads, int maximumJobs, long long budget)
+{
+	struct Pool *	p = malloc(sizeof(*p));
+
+	if ( p == 0 )
+		return 0;
+	memset(p, 0, sizeof(*p));
+	pthread_mutex_init(&p->lock, 0);
+	pthread_cond_init(&p->ready, 0);
+	pthread_cond_init(&p->space, 0);
+	p->maximumJobs = maximumJobs > 0 ? maximumJobs : 1;
+	p->budget = budget;
+	if ( threads > MAXIMUM_THREADS )
+		threads = MAXIMUM_THREADS;
+	for ( p->threads = 0; p->threads < threads; p->threads++ ) {
+		if ( pthread_create(&p->thread[p->threads], 0, work, p) != 0 )
+			break;
+	}
+	if ( p->threads == 0 ) {
+		pool_finish(p);
+		return 0;
+	}
+	return p;
+}
+
+/*
+ * Queue run(argument), which will move about "bytes" bytes. Returns the
+ * pool's status so far, so that the caller can stop feeding it once a
+ * job has failed.
+ */
+extern int
+pool_submit(
+ struct Pool *	p
+,int			(*run)(void * argument)
+,void *			argument
+,long long		bytes)
+{
+	struct Job *	j = malloc(sizeof(*j));
+	int				status;
+
+	if ( j == 0 )
+		return (*run)(argument);
+	j->next = 0;
+	j->run = run;
+	j->argument = argument;
+	j->bytes = bytes;
+
+	pthread_mutex_lock(&p->lock);
+	while ( p->jobs >= p->maximumJobs
+	 || (p->jobs > 0 && p->bytes + bytes > p->budget) )
+		pthread_cond_wait(&p->space, &p->lock);
+	if ( p->last )
+		p->last->next = j;
+	else
+		p->first = j;
+	p->last = j;
+	p->jobs++;
+	p->bytes += bytes;
+	status = p->status;
+	pthread_cond_signal(&p->ready);
+	pthread_mutex_unlock(&p->lock);
+	return status;
+}
+
+/*
+ * Wait for every job submitted so far to finish, for a caller that is
+ * about to do something that depends on them. Returns the pool's status.
+ */
+extern int
+pool_wait(struct Pool * p)
+{
+	int	status;
+
+	pthread_mutex_lock(&p->lock);
+	while ( p->jobs > 0 )
+		pthread_cond_wait(&p->space, &p->lock);
+	status = p->status;
+	pthread_mutex_unlock(&p->lock);
+	return status;
+}
+
+/*
+ * Run everything that was submitted, stop the threads and free the pool.
+ */
+extern int
+pool_finish(struct Pool * p)
+{
+	int	status;
+	int	n;
+
+	pthread_mutex_lock(&p->lock);
+	p->closing = 1;
+	pthread_cond_broadcast(&p->ready);
+	pthread_mutex_unlock(&p->lock);
+	for ( n = 0; n < p->threads; n++ )
+		pthread_join(p->thread[n], 0);
+
+	status = p->status;
+	pthread_mutex_destroy(&p->lock);
+	pthread_cond_destroy(&p->ready);
+	pthread_cond_destroy(&p->space);
+	free(p);
+	return status;
+}
@@ -1,37 +1,49 @@
 #include "internal.h"
+#include <fcntl.h>
 
+/*
+ * Make the changes asked for by -m, -o and -g to the destination, through
+ * "fd" if it is open.
+ */
 extern int
-post_process(const struct FileInfo * i)
+post_process_fd(const struct FileInfo * i, int fd)
 {
+	const struct FileOptions *	o = i->options;
 	int	status = 0;
 
 	if ( i->destination == 0 || *i->destination == 0 )
 		return 0;
 
-	if ( status == 0 && i->changeMode ) {
+	if ( status == 0 && o->changeMode ) {
 		mode_t	mode = i->stat.st_mode & 07777;
-		mode &= i->andWithMode;
-		mode |= i->orWithMode;
-		status = chmod(i->destination, mode);
+		mode &= o->andWithMode;
+		mode |= o->orWithMode;
+		if ( fd >= 0 )
+			status = fchmod(fd, mode);
+		else
+			status = fchmodat(i->destinationFd, i->destinationName, mode, 0);
 
-		if ( status != 0 && i->complainInPostProcess && !i->force ) {
+		if ( status != 0 && o->complainInPostProcess && !o->force ) {
 			name_and_error(i->destination);
 			return 1;
 		}
 	}
 
-	if ( i->changeUserID || i->changeGroupID ) {
+	if ( o->changeUserID || o->changeGroupID ) {
 		uid_t	uid = i->stat.st_uid;
 		gid_t	gid = i->stat.st_gid;
 
-		if ( i->changeUserID )
-			uid = i->userID;
-		if ( i->changeGroupID )
-			gid = i->groupID;
+		if ( o->changeUserID )
+			uid = o->userID;
+		if ( o->changeGroupID )
+			gid = o->groupID;
 
-		status = chown(i->destination, uid, gid);
+		if ( fd >= 0 )
+			status = fchown(fd, uid, gid);
+		else
+			status = fchownat(i->destinationFd, i->destinationName, uid, gid, 0);
 
-		if ( status != 0 && i->complainInPostProcess && !i->force ) {
+		if ( status != 0 && o->complainInPostProcess && !o->force ) {
 			name_and_error(i->destination);
 			return 1;
 		}
@@ -39,3 +51,15 @@ post_process(const struct FileInfo * i)
 
 	return status;
 }
+
+/*
+ * The walkers call this after the applet's function, unless the function
+ * does it itself, at a time of its choosing.
+ */
+extern int
+post_process(const struct FileInfo * i)
+{
+	if ( i->options->postProcessInFunction )
+		return 0;
+	return post_process_fd(i, -1);
+}
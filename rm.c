@@ -1,30 +1,28 @@
 #include "internal.h"
-#include <errno.h>
+#include <fcntl.h>
 
-const char	rm_usage[] = "rm [-r] file [file ...]\n"
+const char	rm_usage[] = "rm [-r] [-j threads] file [file ...]\n"
 "\n"
 "\tDelete files.\n"
 "\n"
-"\t-r:\tRecursively remove files and directories.\n";
+"\t-r:\tRecursively remove files and directories.\n"
+"\t-j:\tUse this many threads to walk the directory tree.\n";
 
 extern int
 rm_main(struct FileInfo * i, int argc, char * * argv)
 {
-	i->processDirectoriesAfterTheirContents = 1;
+	i->options->processDirectoriesAfterTheirContents = 1;
+	i->options->unsorted = 1;
 	return monadic_main(i, argc, argv);
 }
 
 extern int
 rm_fn(const struct FileInfo * i)
 {
-	if ( i->recursive
+	if ( i->options->recursive
 	 && !i->isSymbolicLink
 	 && (i->stat.st_mode & S_IFMT) == S_IFDIR )
 		return rmdir_fn(i);
-	else if ( unlink(i->source) != 0 && errno != ENOENT && !i->force ) {
-		name_and_error(i->source);
-		return 1;
-	}
 	else
-		return 0;
+		return batch_unlink(i, 0);
 }
@@ -1,5 +1,5 @@
 #include "internal.h"
-#include <errno.h>
+#include <fcntl.h>
 
 const char	rmdir_usage[] = "rmdir directory [directory ...]\n"
 "\n"
@@ -8,10 +8,5 @@ const char	rmdir_usage[] = "rmdir directory [directory ...]\n"
 extern int
 rmdir_fn(const struct FileInfo * i)
 {
-	if ( rmdir(i->source) != 0 && errno != ENOENT && !i->force ) {
-		name_and_error(i->source);
-		return 1;
-	}
-	else
-		return 0;
+	return batch_unlink(i, AT_REMOVEDIR);
 }
@@ -29,11 +29,11 @@ Read(void * userData, char * buffer, int length)
 }
 
 static int
-IOError(TarInfo * i)
+NameError(const char * name)
 {
     int error = errno;  /* fflush() could cause errno to change */
     fflush(stdout);
-    fprintf(stderr, "%s: %s\n", i->Name, strerror(error));
+    fprintf(stderr, "%s: %s\n", name, strerror(error));
 
     /*
      * The status returned by a coroutine of TarExtractor(), if it
@@ -42,6 +42,27 @@ IOError(TarInfo * i)
     return -2;
 }
 
+static int
+IOError(TarInfo * i)
+{
+    return NameError(i->Name);
+}
+
+/*
+ * A symbolic link in the file's place is replaced, not written through.
+ */
+static int
+CreateFile(const char * name, mode_t mode)
+{
+    int fd = open(name, O_CREAT|O_TRUNC|O_WRONLY|O_NOFOLLOW, mode & ~S_IFMT);
+
+    if ( fd < 0 ) {
+        unlink(name);
+        fd = open(name, O_CREAT|O_TRUNC|O_WRONLY|O_NOFOLLOW, mode & ~S_IFMT);
+    }
+    return fd;
+}
+
 static int
 ExtractFile(TarInfo * i)
 {
@@ -51,45 +72,30 @@ ExtractFile(TarInfo * i)
      * return 0.
      */
 
-    int fd = open(i->Name, O_CREAT|O_TRUNC|O_WRONLY, i->Mode & ~S_IFMT);
+    int fd = CreateFile(i->Name, i->Mode);
     size_t  size = i->Size;
+    size_t  padding = (512 - size % 512) % 512;
+    long long copied;
     struct utimbuf t;
-        
-    if ( fd < 0 ) {
-        unlink(i->Name);
-        fd = open(i->Name, O_CREAT|O_TRUNC|O_WRONLY, i->Mode & ~S_IFMT);
-        if ( fd < 0 )
-            return IOError(i);
-    }
-
-    verbose("File: %s\n", i->Name);
 
-    while ( size > 0 ) {
-        char    buffer[1024 * 128];
-        size_t  writeSize;
-        size_t  readSize;
-
-        if ( size > sizeof(buffer) )
-            writeSize = readSize = sizeof(buffer);
-        else {
-            int mod = size % 512;
-            if ( mod != 0 )
-                readSize = size + (512 - mod);
-            else
-                readSize = size;
-            writeSize = size;
-        }
-
-        if ( (readSize = Read(i->UserData, buffer, readSize)) <= 0 )
-            return -1;  /* Something wrong with archive */
-
-        if ( readSize < writeSize )
-            writeSize = readSize;
+    if ( fd < 0 )
+        return IOError(i);
 
-        if ( write(fd, buffer, writeSize) != writeSize )
-            return IOError(i);  /* Write failure. */
+    verbose("File: %s\n", i->Name);
 
-        size -= writeSize;
+    /*
+     * Read() is a plain read() of the archive descriptor, so the copy
+     * engine can take the data straight from it.
+     */
+    copied = copy_data((int)(long)i->UserData, fd, size);
+    if ( copied < 0 ) {
+        int status = IOError(i);
+        close(fd);
+        return status;
+    }
+    if ( copied < size || skip_data((int)(long)i->UserData, padding) != 0 ) {
+        close(fd);
+        return -1;  /* Something wrong with archive */
     }
     /* fchown() and fchmod() are cheaper than chown() and chmod(). */
     fchown(fd, i->UserID, i->GroupID);
@@ -192,15 +198,386 @@ static const TarFunctions   functions = {
     MakeSpecialFile
 };
 
-const char  star_usage[] = "star\n"
+/*
+ * With -j, the archive is read here through a large buffer, and each
+ * regular file is handed to a pool of threads that create it, write it
+ * and set its owner, mode and time. Directories, links and special files
+ * are still made here, in archive order, so a file's directory is always
+ * there before the file is handed out. A hard link first waits for the
+ * files already handed out, since its target may be one of them. Files
+ * too big to hold in memory are written here as well.
+ *
+ * Anything made here whose name is that of a file handed out, or of a
+ * directory one is in, waits for the pool first, so that it happens in
+ * archive order. So does a file handed out under a name already in use.
+ */
+
+#define INPUT_BUFFER_SIZE   (1024 * 1024)
+#define IN_FLIGHT           (64 * 1024 * 1024)
+#define JOBS_PER_THREAD     16
+#define LARGE_FILE          (8 * 1024 * 1024)
+#define PENDING_SIZE        4096    /* A power of two */
+
+struct ExtractJob {
+    char *      name;
+    char *      data;
+    long long   size;
+    mode_t      mode;
+    uid_t       userID;
+    gid_t       groupID;
+    time_t      modTime;
+};
+
+static struct Pool *    pool = 0;
+static int      handedOut = 0;      /* Since the pool was last waited for */
+static char *   input = 0;
+/*
+ * Hashes of the names handed out since the pool was last waited for, and
+ * of the directories above them. Two names with the same hash only cost
+ * an unneeded wait.
+ */
+static unsigned long    pending[PENDING_SIZE];
+static int      pendingCount = 0;
+static long     inputStart = 0;
+static long     inputEnd = 0;
+
+/*
+ * Take "length" bytes of the archive into "to", or skip them if "to" is 0.
+ * Returns the number taken, which is short at the end of the archive.
+ */
+static long long
+TakeInput(char * to, long long length)
+{
+    long long   done = 0;
+
+    while ( done < length ) {
+        long    n = inputEnd - inputStart;
+
+        if ( n == 0 ) {
+            inputStart = inputEnd = 0;
+            do
+                n = read(0, input, INPUT_BUFFER_SIZE);
+            while ( n < 0 && errno == EINTR );
+            if ( n <= 0 )
+                return n < 0 ? -1 : done;
+            inputEnd = n;
+        }
+        if ( n > length - done )
+            n = length - done;
+        if ( to )
+            memcpy(&to[done], &input[inputStart], n);
+        inputStart += n;
+        done += n;
+    }
+    return done;
+}
+
+static int
+BufferedRead(void * userData, char * buffer, int length)
+{
+    return (int)TakeInput(buffer, length);
+}
+
+static int
+WriteFully(int fd, const char * buffer, long long length)
+{
+    while ( length > 0 ) {
+        long    n = write(fd, buffer, length);
+
+        if ( n < 0 && errno == EINTR )
+            continue;
+        if ( n <= 0 )
+            return -1;
+        buffer += n;
+        length -= n;
+    }
+    return 0;
+}
+
+static void
+SetFileModes(int fd, uid_t userID, gid_t groupID, mode_t mode, time_t modTime)
+{
+    struct timespec t[2];
+
+    fchown(fd, userID, groupID);
+    fchmod(fd, mode & ~S_IFMT);
+    t[0].tv_nsec = UTIME_NOW;
+    t[1].tv_sec = modTime;
+    t[1].tv_nsec = 0;
+    futimens(fd, t);
+}
+
+/*
+ * Runs on the pool.
+ */
+static int
+WriteFile(void * argument)
+{
+    struct ExtractJob * j = (struct ExtractJob *)argument;
+    int fd = CreateFile(j->name, j->mode);
+    int status = 0;
+
+    if ( fd < 0 || WriteFully(fd, j->data, j->size) != 0 )
+        status = NameError(j->name);
+    if ( fd >= 0 ) {
+        SetFileModes(fd, j->userID, j->groupID, j->mode, j->modTime);
+        close(fd);
+    }
+    free(j);
+    return status;
+}
+
+/*
+ * A file too big to hold: what is in the buffer, then the rest straight
+ * from the archive.
+ */
+static int
+ExtractLargeFile(TarInfo * i)
+{
+    long long   size = i->Size;
+    long long   padding = (512 - size % 512) % 512;
+    long long   buffered = inputEnd - inputStart;
+    long long   copied;
+    int fd = CreateFile(i->Name, i->Mode);
+
+    verbose("File: %s\n", i->Name);
+
+    if ( fd < 0 )
+        return IOError(i);
+    if ( buffered > size )
+        buffered = size;
+    if ( WriteFully(fd, &input[inputStart], buffered) != 0
+     || (copied = copy_data(0, fd, size - buffered)) < 0 ) {
+        int status = IOError(i);
+        close(fd);
+        return status;
+    }
+    inputStart += buffered;
+    if ( copied < size - buffered || TakeInput(0, padding) != padding ) {
+        close(fd);
+        return -1;  /* Something wrong with archive */
+    }
+    SetFileModes(fd, i->UserID, i->GroupID, i->Mode, i->ModTime);
+    close(fd);
+    return 0;
+}
+
+/*
+ * The hash of the first "length" bytes of "name", which is never 0.
+ */
+static unsigned long
+NameHash(const char * name, int length)
+{
+    unsigned long   h = 2166136261UL;
+    int n;
+
+    for ( n = 0; n < length; n++ )
+        h = (h ^ (unsigned char)name[n]) * 16777619UL;
+    return h ? h : 1;
+}
+
+static unsigned long *
+PendingSlot(unsigned long h)
+{
+    unsigned long   n = h & (PENDING_SIZE - 1);
+
+    while ( pending[n] != 0 && pending[n] != h )
+        n = (n + 1) & (PENDING_SIZE - 1);
+    return &pending[n];
+}
+
+/* The length of the name without any trailing slashes. */
+static int
+NameLength(const char * name)
+{
+    int length = strlen(name);
+
+    while ( length > 1 && name[length - 1] == '/' )
+        length--;
+    return length;
+}
+
+static int
+IsPending(const char * name)
+{
+    return ( pendingCount > 0
+     && *PendingSlot(NameHash(name, NameLength(name))) != 0 );
+}
+
+/*
+ * Remember the name, and the names of the directories above it.
+ */
+static void
+AddPending(const char * name)
+{
+    int length = NameLength(name);
+    int n;
+
+    for ( n = 1; n <= length; n++ ) {
+        if ( n == length || name[n] == '/' ) {
+            unsigned long   h = NameHash(name, n);
+            unsigned long * slot = PendingSlot(h);
+
+            if ( *slot == 0 ) {
+                *slot = h;
+                pendingCount++;
+            }
+        }
+    }
+}
+
+static int
+WaitForFiles(void)
+{
+    int status = 0;
+
+    if ( handedOut ) {
+        status = pool_wait(pool);
+        handedOut = 0;
+    }
+    if ( pendingCount > 0 ) {
+        memset(pending, 0, sizeof(pending));
+        pendingCount = 0;
+    }
+    return status;
+}
+
+static int
+ExtractFileLater(TarInfo * i)
+{
+    long long   size = i->Size;
+    long long   padding = (512 - size % 512) % 512;
+    int length = strlen(i->Name) + 1;
+    struct ExtractJob * j;
+    int status;
+
+    if ( (IsPending(i->Name) || pendingCount + length > PENDING_SIZE / 2)
+     && (status = WaitForFiles()) != 0 )
+        return status;
+    if ( size > LARGE_FILE )
+        return ExtractLargeFile(i);
+    if ( (j = malloc(sizeof(*j) + length + size)) == 0 )
+        return IOError(i);
+
+    verbose("File: %s\n", i->Name);
+
+    j->name = (char *)(j + 1);
+    memcpy(j->name, i->Name, length);
+    j->data = &j->name[length];
+    j->size = size;
+    j->mode = i->Mode;
+    j->userID = i->UserID;
+    j->groupID = i->GroupID;
+    j->modTime = i->ModTime;
+    if ( TakeInput(j->data, size) != size || TakeInput(0, padding) != padding ) {
+        free(j);
+        return -1;  /* Something wrong with archive */
+    }
+    handedOut = 1;
+    AddPending(i->Name);
+    return pool_submit(pool, WriteFile, j, size);
+}
+
+static int
+MakeHardLinkInOrder(TarInfo * i)
+{
+    int status = WaitForFiles();
+
+    return status != 0 ? status : MakeHardLink(i);
+}
+
+static int
+MakeDirectoryInOrder(TarInfo * i)
+{
+    int status = IsPending(i->Name) ? WaitForFiles() : 0;
+
+    return status != 0 ? status : MakeDirectory(i);
+}
+
+static int
+MakeSymbolicLinkInOrder(TarInfo * i)
+{
+    int status = IsPending(i->Name) ? WaitForFiles() : 0;
+
+    return status != 0 ? status : MakeSymbolicLink(i);
+}
+
+static int
+MakeSpecialFileInOrder(TarInfo * i)
+{
+    int status = IsPending(i->Name) ? WaitForFiles() : 0;
+
+    return status != 0 ? status : MakeSpecialFile(i);
+}
+
+static const TarFunctions   pipelinedFunctions = {
+    BufferedRead,
+    ExtractFileLater,
+    MakeDirectoryInOrder,
+    MakeHardLinkInOrder,
+    MakeSymbolicLinkInOrder,
+    MakeSpecialFileInOrder
+};
+
+const char  star_usage[] = "star [-j threads] [--numeric-owner]\n"
 "\n"
 "\tExtracts a tar archive from the standard input.\n"
+"\n"
+"\t-j:\tRead the archive on one thread, and create and write the files\n"
+"\t\ton this many others.\n"
+"\t--numeric-owner:\n"
+"\t\tGive the files the user and group IDs in the archive, rather\n"
+"\t\tthan looking up the names that go with them.\n"
 "\n";
 
 int
 star_main(struct FileInfo * i, int argc, char * * argv)
 {
-    int status = TarExtractor((void *)0, &functions);
+    TarFunctions    f = functions;
+    int threads = 0;
+    int numericOwner = 0;
+    int status;
+
+    while ( argc > 1 ) {
+        if ( strcmp(argv[1], "--numeric-owner") == 0 )
+            numericOwner = 1;
+        else if ( strncmp(argv[1], "-j", 2) == 0 ) {
+            if ( argv[1][2] != '\0' )
+                threads = atoi(&argv[1][2]);
+            else if ( argc > 2 ) {
+                threads = atoi(argv[2]);
+                argc--;
+                argv++;
+            }
+            if ( threads <= 0 ) {
+                usage(star_usage);
+                return 1;
+            }
+        }
+        else {
+            usage(star_usage);
+            return 1;
+        }
+        argc--;
+        argv++;
+    }
+
+    if ( threads > 0
+     && (input = malloc(INPUT_BUFFER_SIZE)) != 0
+     && (pool = pool_create(threads, threads * JOBS_PER_THREAD, IN_FLIGHT)) != 0 ) {
+        int finished;
+
+        f = pipelinedFunctions;
+        f.NumericOwner = numericOwner;
+        status = TarExtractor((void *)0, &f);
+        finished = pool_finish(pool);
+        if ( status == 0 )
+            status = finished;
+    }
+    else {
+        f.NumericOwner = numericOwner;
+        status = TarExtractor((void *)0, &f);
+    }
 
     if ( status == -1 ) {
         fflush(stdout);
@@ -6,6 +6,21 @@
 #include <errno.h>
 #include <string.h>
 #include <time.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <fnmatch.h>
+#include <sys/stat.h>
+
+/*
+ * What to do with the files that are picked out: write them one after
+ * another to stdout, each to a file of its own name, or as a tar archive
+ * of just those files to stdout.
+ */
+enum Output {
+    CatOutput = 0,
+    FileOutput,
+    TarOutput
+};
 
 static int
 IOError(TarInfo * i)
@@ -13,115 +28,622 @@ IOError(TarInfo * i)
     int error = errno;  /* fflush() could cause errno to change */
     fflush(stdout);
     fprintf(stderr, "%s: %s\n", i->Name, strerror(error));
+    return 1;
+}
+
+static int
+formatError(void)
+{
+    errno = 0;      /* Indicates broken tarfile */
+    fprintf(stderr, "Error in archive format.\n");
+    return 1;
+}
+
+/*
+ * read(), or pread() at "*offset" if "positioned", that only stops short
+ * at the end of the archive. The offset is moved on either way.
+ */
+static long
+readFully(char * buffer, long length, long long * offset, int positioned)
+{
+    long    done = 0;
+
+    while ( done < length ) {
+        long    n;
 
-    /*
-     * The status returned by a coroutine of TarExtractor(), if it
-     * is non-zero, will be returned to the caller of TarExtractor().
-     */
-    return -2;
+        if ( positioned )
+            n = pread(0, &buffer[done], length - done, *offset + done);
+        else
+            n = read(0, &buffer[done], length - done);
+        if ( n < 0 && errno == EINTR )
+            continue;
+        if ( n < 0 )
+            return -1;
+        if ( n == 0 )
+            break;
+        done += n;
+    }
+    *offset += done;
+    return done;
 }
 
+/*
+ * The records that make up a member before its data: any GNU long name
+ * records, then its header. They are kept as they were read, so that
+ * they can be written out again.
+ */
+struct Records {
+    char *  data;
+    long    length;
+    long    allocated;
+};
+
+static char *
+extendRecords(struct Records * r, long length)
+{
+    if ( r->length + length > r->allocated ) {
+        long    allocated = (r->length + length) * 2;
+        char *  data = realloc(r->data, allocated);
+
+        if ( data == 0 )
+            return 0;
+        r->data = data;
+        r->allocated = allocated;
+    }
+    r->length += length;
+    return &r->data[r->length - length];
+}
+
+/*
+ * Read the records of the member at "*offset", and decode its header into
+ * "h", with the long name if there was one. Returns 0, 1 at the end of the
+ * archive, or -1 if the archive is broken.
+ */
 static int
-catFile(TarInfo * i, int do_write)
-{
-#define BUFF 1024 * 128
-    size_t  size = i->Size;
-        
-    while ( (int)size > 0 ) {
-        char    buffer[BUFF];
-        size_t  writeSize;
-        size_t  readSize;
-
-        if ( size > BUFF )
-            writeSize = readSize = BUFF;
-        else {
-            int mod = size % 512;
-            if ( mod != 0 )
-                readSize = size + (512 - mod);
-            else
-	        readSize = size;
-            writeSize = size;
+readMember(struct Records * r, long long * offset, int positioned, TarInfo * h)
+{
+    long    nameAt = -1;
+
+    r->length = 0;
+    for ( ; ; ) {
+        char *  block = extendRecords(r, 512);
+        long    n;
+
+        if ( block == 0 )
+            return -1;
+        n = readFully(block, 512, offset, positioned);
+        if ( n == 0 && r->length == 512 )
+            return 1;
+        if ( n != 512 )
+            return -1;
+        if ( !DecodeNumericTarHeader(block, h) )
+            return ( h->Name[0] == '\0' && r->length == 512 ) ? 1 : -1;
+        if ( h->Name[0] == '\0' )
+            return -1;
+        if ( h->Type == LongName || h->Type == LongLinkName ) {
+            long    padded = (h->Size + 511) & ~511L;
+            TarFileType type = h->Type;
+            size_t  size = h->Size;
+            char *  data;
+
+            if ( size == 0 || size > PATH_MAX * 4
+             || (data = extendRecords(r, padded)) == 0
+             || readFully(data, padded, offset, positioned) != padded )
+                return -1;
+            data[size - 1] = '\0';
+            if ( type == LongName )
+                nameAt = data - r->data;
+            continue;
         }
+        break;
+    }
+    /* The buffer has stopped moving, so the long name can be pointed to. */
+    if ( nameAt >= 0 )
+        h->Name = &r->data[nameAt];
+    return 0;
+}
 
-        if ( (readSize = read(0, buffer, readSize)) < 0) {
-	    fprintf(stderr,"Error reading data: %d\n",readSize);
-            return -1;  /* Something wrong with archive */
-	}
+static int
+isRegularFile(const TarInfo * h)
+{
+    return ( (h->Type == NormalFile0 || h->Type == NormalFile1)
+     && h->Name[strlen(h->Name) - 1] != '/' );
+}
 
-/*        if ( readSize < writeSize ) */
-            writeSize = readSize;
+/*
+ * Which of the patterns "name" matches: a name, a shell pattern, or a
+ * directory, which takes in everything within it. Each pattern that
+ * matches is marked in "found".
+ */
+static int
+selected(char * const * patterns, int count, char * found, const char * name)
+{
+    int     matched = 0;
+    int     n;
 
-        if (do_write) {
-	    if ( write(1, buffer, writeSize) != writeSize ) {
-		fprintf(stderr,"Error writing data\n");
-                return IOError(i);  /* Write failure. */
-	    }
+    for ( n = 0; n < count; n++ ) {
+        if ( strcmp(patterns[n], name) == 0
+         || fnmatch(patterns[n], name, FNM_LEADING_DIR) == 0 ) {
+            found[n] = 1;
+            matched = 1;
         }
+    }
+    return matched;
+}
 
-        size -= writeSize;
+/*
+ * Create "name" below the current directory, with the directories that
+ * lead to it. Names that would climb out are refused.
+ */
+static int
+createFile(const char * name, mode_t mode)
+{
+    char    path[PATH_MAX];
+    char *  s;
+
+    while ( *name == '/' )
+        name++;
+    if ( strcmp(name, "..") == 0 || strncmp(name, "../", 3) == 0
+     || strstr(name, "/../") != 0
+     || (strlen(name) >= 3 && strcmp(&name[strlen(name) - 3], "/..") == 0) ) {
+        errno = EPERM;
+        return -1;
+    }
+    if ( strlen(name) >= sizeof(path) ) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(path, name);
+    for ( s = strchr(path, '/'); s != 0; s = strchr(s + 1, '/') ) {
+        *s = '\0';
+        if ( mkdir(path, 0777) != 0 && errno != EEXIST )
+            return -1;
+        *s = '/';
     }
+    unlink(path);
+    return open(path, O_WRONLY|O_CREAT|O_TRUNC, mode & 07777);
+}
+
+/*
+ * Write out the member whose records are in "r". The archive is at the
+ * start of its data, and is left at the start of the next member.
+ */
+static int
+writeMember(enum Output output, const struct Records * r, TarInfo * h)
+{
+    long long   size = h->Size;
+    long long   padded = (size + 511) & ~511LL;
+    long long   copied;
+    long        done = 0;
+    int         fd = 1;
+    int         status = 0;
+
+    switch ( output ) {
+    case CatOutput:
+        break;
+    case FileOutput:
+        if ( (fd = createFile(h->Name, h->Mode)) < 0 )
+            return IOError(h);
+        break;
+    case TarOutput:
+        while ( done < r->length ) {
+            long    n = write(1, &r->data[done], r->length - done);
+
+            if ( n < 0 && errno == EINTR )
+                continue;
+            if ( n <= 0 )
+                return IOError(h);
+            done += n;
+        }
+        size = padded;
+        break;
+    }
+
+    copied = copy_data(0, fd, size);
+    if ( copied < 0 )
+        status = IOError(h);
+    else if ( copied < size || skip_data(0, padded - size) != 0 ) {
+        fprintf(stderr, "Error reading data\n");
+        status = 1;     /* Something wrong with archive */
+    }
+    if ( output == FileOutput ) {
+        struct timespec t[2];
+
+        t[0].tv_nsec = UTIME_NOW;
+        t[1].tv_sec = h->ModTime;
+        t[1].tv_nsec = 0;
+        futimens(fd, t);
+        if ( close(fd) != 0 && status == 0 )
+            status = IOError(h);
+    }
+    return status;
+}
+
+/*
+ * An index of the regular files in an archive, kept in a file of its own:
+ * a header that says which archive it describes, then a record for each
+ * member with the offset of its first record, its size and mode, and its
+ * name. With the index and an archive that can seek, a member is found
+ * with one look at its header, however big the archive is.
+ */
+
+#define INDEX_MAGIC "TARIDX2"
+
+struct IndexHeader {
+    char        magic[8];
+    long long   archiveSize;    /* Of the archive described */
+    long long   archiveTime;    /* Its st_mtim, in nanoseconds */
+    long long   count;
+};
+
+struct IndexRecord {
+    long long   offset;         /* Of the member's first record */
+    long long   size;
+    unsigned int mode;
+    unsigned int nameLength;    /* The name follows, without a NUL */
+};
+
+struct Member {
+    long long   offset;
+    long long   size;
+    mode_t      mode;
+    char *      name;
+};
+
+struct Index {
+    struct Member * members;
+    long        count;
+    long        allocated;
+};
+
+static long long
+modificationTime(const struct stat * s)
+{
+    return s->st_mtim.tv_sec * 1000000000LL + s->st_mtim.tv_nsec;
+}
+
+static int
+addMember(struct Index * x, long long offset, const TarInfo * h)
+{
+    struct Member * m;
+
+    if ( x->count == x->allocated ) {
+        long    allocated = x->allocated ? x->allocated * 2 : 256;
+
+        if ( (m = realloc(x->members, allocated * sizeof(*m))) == 0 )
+            return -1;
+        x->members = m;
+        x->allocated = allocated;
+    }
+    m = &x->members[x->count];
+    if ( (m->name = strdup(h->Name)) == 0 )
+        return -1;
+    m->offset = offset;
+    m->size = h->Size;
+    m->mode = h->Mode;
+    x->count++;
     return 0;
 }
 
-const char  tarcat_usage[] = "tarcat filename\n"
-"\n"
-"\tExtracts a file to stdout from a tar archive on the standard input.\n"
-"\n";
+static void
+freeIndex(struct Index * x)
+{
+    long    n;
 
-int
-tarcat_main(struct FileInfo * i, int argc, char * * argv)
+    for ( n = 0; n < x->count; n++ )
+        free(x->members[n].name);
+    free(x->members);
+    memset(x, 0, sizeof(*x));
+}
+
+/*
+ * Load the index in "name", if it describes the archive "s" is the
+ * stat() of.
+ */
+static int
+loadIndex(const char * name, const struct stat * s, struct Index * x)
+{
+    struct IndexHeader  header;
+    FILE *  f = fopen(name, "r");
+    long long   n;
+
+    if ( f == 0 )
+        return -1;
+    if ( fread(&header, sizeof(header), 1, f) != 1
+     || memcmp(header.magic, INDEX_MAGIC, sizeof(header.magic)) != 0
+     || header.archiveSize != s->st_size
+     || header.archiveTime != modificationTime(s) ) {
+        fclose(f);
+        return -1;
+    }
+    for ( n = 0; n < header.count; n++ ) {
+        struct IndexRecord  r;
+        char *  memberName;
+        TarInfo h;
+
+        if ( fread(&r, sizeof(r), 1, f) != 1
+         || (memberName = malloc(r.nameLength + 1)) == 0 )
+            break;
+        if ( fread(memberName, 1, r.nameLength, f) != r.nameLength ) {
+            free(memberName);
+            break;
+        }
+        memberName[r.nameLength] = '\0';
+        h.Name = memberName;
+        h.Size = r.size;
+        h.Mode = r.mode;
+        if ( addMember(x, r.offset, &h) != 0 ) {
+            free(memberName);
+            break;
+        }
+        free(memberName);
+    }
+    fclose(f);
+    if ( n < header.count ) {
+        freeIndex(x);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Written to a new file that then takes the index's name, so that a
+ * reader never sees half an index.
+ */
+static int
+saveIndex(const char * name, const struct stat * s, const struct Index * x)
 {
-    int     status;
-    char    buffer[512];
+    struct IndexHeader  header;
+    char    temporary[PATH_MAX];
+    FILE *  f;
+    long    n;
+
+    snprintf(temporary, sizeof(temporary), "%s.%d", name, (int)getpid());
+    if ( (f = fopen(temporary, "w")) == 0 ) {
+        name_and_error(temporary);
+        return 1;
+    }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.archiveSize = s->st_size;
+    header.archiveTime = modificationTime(s);
+    header.count = x->count;
+    fwrite(&header, sizeof(header), 1, f);
+    for ( n = 0; n < x->count; n++ ) {
+        struct IndexRecord  r;
+
+        memset(&r, 0, sizeof(r));
+        r.offset = x->members[n].offset;
+        r.size = x->members[n].size;
+        r.mode = x->members[n].mode;
+        r.nameLength = strlen(x->members[n].name);
+        fwrite(&r, sizeof(r), 1, f);
+        fwrite(x->members[n].name, 1, r.nameLength, f);
+    }
+    if ( ferror(f) | (fclose(f) != 0) || rename(temporary, name) != 0 ) {
+        name_and_error(name);
+        unlink(temporary);
+        return 1;
+    }
+    return 0;
+}
+
+struct Selection {
+    char * const *  patterns;
+    int         count;
+    char *      found;      /* Which patterns have matched */
+    enum Output output;
+};
+
+/*
+ * Go straight to each member the selection picks. Its records are read
+ * again first, in case the archive has changed under the index. Returns
+ * -1 if it has, and nothing has been written yet, with "found" cleared
+ * again for the scan that will take its place.
+ */
+static int
+extractIndexed(const struct Index * x, struct Selection * s)
+{
+    struct Records  r;
     TarInfo h;
-    char *filename = NULL;
-
-    filename = argv[1];
-
-    while ( (status = read(0, buffer, 512)) == 512) {
-        int     nameLength;
-        if ( !DecodeTarHeader(buffer, &h) ) {
-            if ( h.Name[0] == '\0' ) {
-                return 0;       /* End of tape */
-            } else {
-                errno = 0;      /* Indicates broken tarfile */
-                fprintf(stderr, "Error in archive format.\n");
-                return 1;      /* Header checksum error */
+    int     written = 0;
+    int     status = 0;
+    long    n;
+
+    memset(&r, 0, sizeof(r));
+    for ( n = 0; n < x->count && status == 0; n++ ) {
+        const struct Member *   m = &x->members[n];
+        long long   offset = m->offset;
+
+        if ( !selected(s->patterns, s->count, s->found, m->name) )
+            continue;
+        if ( readMember(&r, &offset, 1, &h) != 0
+         || !isRegularFile(&h)
+         || h.Size != m->size
+         || strcmp(h.Name, m->name) != 0
+         || lseek(0, offset, SEEK_SET) < 0 ) {
+            if ( !written ) {
+                memset(s->found, 0, s->count);
+                free(r.data);
+                return -1;
             }
+            fprintf(stderr, "The index doesn't match the archive.\n");
+            status = 1;
+            break;
         }
-        if ( h.Name[0] == '\0' ) {
-            errno = 0;      /* Indicates broken tarfile */
-            fprintf(stderr, "Error in archive format.\n");
-            return 1;      /* Bad header data */
+        written = 1;
+        status = writeMember(s->output, &r, &h);
+    }
+    free(r.data);
+    return status;
+}
+
+/*
+ * Read the archive from where it is, writing out each member that the
+ * selection picks and, if "x" isn't 0, adding every regular file to the
+ * index.
+ */
+static int
+scan(struct Selection * s, struct Index * x)
+{
+    struct Records  r;
+    long long   offset = lseek(0, 0, SEEK_CUR);
+    TarInfo h;
+    int     status = 0;
+    int     n;
+
+    if ( offset < 0 )
+        offset = 0;
+    memset(&r, 0, sizeof(r));
+    for ( ; ; ) {
+        long long   start = offset;
+        long long   padded;
+
+        if ( (n = readMember(&r, &offset, 0, &h)) != 0 ) {
+            if ( n < 0 )
+                status = formatError();
+            break;
         }
-        nameLength = strlen(h.Name);
         switch ( h.Type ) {
-	    case NormalFile0:
-	    case NormalFile1:
-        	if ( h.Name[nameLength - 1] != '/' ) {
-		    if ( 0 == strcmp(h.Name,filename) ) {
-                        status = catFile(&h,1);
-                    } else {
-                        status = catFile(&h,0);
-                    }
-                }
-            case Directory:
-            case HardLink:
-            case SymbolicLink:
-            case CharacterDevice:
-            case BlockDevice:
-            case FIFO:
-                break;
-            default:
-                errno = 0;      /* Indicates broken tarfile */
-                fprintf(stderr, "Error in archive format.\n");
-                return 1;      /* Bad header field */
+        case NormalFile0:
+        case NormalFile1:
+            break;
+        case Directory:
+        case HardLink:
+        case SymbolicLink:
+        case CharacterDevice:
+        case BlockDevice:
+        case FIFO:
+            continue;
+        default:
+            status = formatError();   /* Bad header field */
+            break;
+        }
+        if ( status != 0 )
+            break;
+        if ( !isRegularFile(&h) )
+            continue;
+
+        padded = (h.Size + 511) & ~511LL;
+        if ( x && addMember(x, start, &h) != 0 ) {
+            status = IOError(&h);
+            break;
+        }
+        if ( selected(s->patterns, s->count, s->found, h.Name) )
+            status = writeMember(s->output, &r, &h);
+        else if ( skip_data(0, padded) != 0 )
+            status = formatError();
+        offset += padded;
+        if ( status != 0 )
+            break;
+    }
+    free(r.data);
+    return status;
+}
+
+const char  tarcat_usage[] = "tarcat [-i index] [-x | -t] {name ... | -b}\n"
+"\n"
+"\tExtracts regular files to stdout from a tar archive on the standard\n"
+"\tinput, in one pass and in the order they are in the archive. A name\n"
+"\tmay be a shell pattern, and a directory takes in everything within it.\n"
+"\n"
+"\t-x:\tWrite each file to a file of its own name instead.\n"
+"\t-t:\tWrite a tar archive of just those files instead.\n"
+"\t-i:\tKeep an index of the archive's files in this file, and use it\n"
+"\t\tto go straight to the files when the archive can seek. The index\n"
+"\t\tis made on first use, and again once the archive has changed.\n"
+"\t-b:\tOnly make the index.\n"
+"\n";
+
+int
+tarcat_main(struct FileInfo * i, int argc, char * * argv)
+{
+    const char *    indexName = 0;
+    int     buildOnly = 0;
+    struct Selection    selection;
+    struct stat s;
+    struct Index    x;
+    int     status = -1;
+    int     n;
+
+    memset(&selection, 0, sizeof(selection));
+    while ( argc > 1 && argv[1][0] == '-' ) {
+        if ( strcmp(argv[1], "-b") == 0 )
+            buildOnly = 1;
+        else if ( strcmp(argv[1], "-x") == 0 )
+            selection.output = FileOutput;
+        else if ( strcmp(argv[1], "-t") == 0 )
+            selection.output = TarOutput;
+        else if ( strcmp(argv[1], "-i") == 0 && argc > 2 ) {
+            indexName = argv[2];
+            argc--;
+            argv++;
+        }
+        else {
+            usage(tarcat_usage);
+            return 1;
         }
+        argc--;
+        argv++;
     }
-    if ( status != 0 ) {     /* Read partial header record */
-        errno = 0;      /* Indicates broken tarfile */
-        fprintf(stderr, "Error in archive format.\n");
+    if ( (argc > 1) == buildOnly || (buildOnly && !indexName) ) {
+        usage(tarcat_usage);
         return 1;
     }
-    return 0;
+    /* "dir/" is taken as "dir". */
+    for ( n = 1; n < argc; n++ ) {
+        char *  end = &argv[n][strlen(argv[n])];
+
+        while ( end > &argv[n][1] && end[-1] == '/' )
+            *--end = '\0';
+    }
+    selection.patterns = &argv[1];
+    selection.count = argc - 1;
+    if ( (selection.found = calloc(argc, 1)) == 0 ) {
+        name_and_error(argv[0]);
+        return 1;
+    }
+
+    /* Only a file can be indexed: a pipe won't be the same next time. */
+    if ( indexName && (fstat(0, &s) != 0 || !S_ISREG(s.st_mode)) ) {
+        if ( buildOnly ) {
+            fprintf(stderr, "tarcat: only an archive in a file can be indexed\n");
+            return 1;
+        }
+        indexName = 0;
+    }
+
+    memset(&x, 0, sizeof(x));
+    if ( indexName && !buildOnly && loadIndex(indexName, &s, &x) == 0 ) {
+        status = extractIndexed(&x, &selection);
+        freeIndex(&x);
+        if ( status < 0 && lseek(0, 0, SEEK_SET) < 0 )
+            status = formatError();
+    }
+    if ( status < 0 ) {
+        status = scan(&selection, indexName ? &x : 0);
+        if ( status == 0 && indexName )
+            status = saveIndex(indexName, &s, &x);
+        freeIndex(&x);
+    }
+
+    /* Two blocks of zeros end the archive. */
+    if ( status == 0 && selection.output == TarOutput ) {
+        static const char   zeros[1024];
+
+        if ( write(1, zeros, sizeof(zeros)) != sizeof(zeros) ) {
+            name_and_error("stdout");
+            status = 1;
+        }
+    }
+
+    for ( n = 0; n < selection.count; n++ ) {
+        if ( !selection.found[n] ) {
+            fprintf(stderr, "%s: not found in archive\n", selection.patterns[n]);
+            if ( status == 0 )
+                status = 1;
+        }
+    }
+    free(selection.found);
+    return status;
 }
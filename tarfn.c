@@ -1,9 +1,10 @@
 /*
- * Functions for extracting tar archives.
+ * Functions for extracting and creating tar archives.
  * Bruce Perens, April-May 1995
  * Copyright (C) 1995 Bruce Perens
  * This is free software under the GNU General Public License.
  */
+#include "internal.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -11,6 +12,11 @@
 #include <grp.h>
 #include <errno.h>
 #include <string.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include "tarfn.h"
 
 struct TarHeader {
@@ -34,11 +40,24 @@ typedef struct TarHeader	TarHeader;
 static const unsigned int	TarChecksumOffset
 	= (unsigned int)&(((TarHeader *)0)->Checksum);
 
-/* Octal-ASCII-to-long */
-static long
+/* The name of the GNU records that hold a long name for the next header */
+static const char	LongNameRecord[] = "././@LongLink";
+
+/*
+ * Octal-ASCII-to-long. A number too big for the field is stored in
+ * base-256, GNU style, with the top bit of the first byte set.
+ */
+static long long
 OtoL(const char * s, int size)
 {
-	int	n = 0;
+	long long	n = 0;
+
+	if ( *s & 0x80 ) {
+		n = *s++ & 0x3f;
+		while ( --size > 0 )
+			n = (n << 8) | (unsigned char)*s++;
+		return n;
+	}
 
 	while ( *s == ' ' ) {
 		s++;
@@ -51,42 +70,55 @@ OtoL(const char * s, int size)
 	return n;
 }
 
-extern int
-DecodeTarHeader(char * block, TarInfo * d)
+/*
+ * With "lookUpNames", the user and group names in the header take the
+ * place of its numeric IDs, where they exist here.
+ */
+static int
+Decode(char * block, TarInfo * d, int lookUpNames)
 {
 	TarHeader *			h = (TarHeader *)block;
 	unsigned char *		s = (unsigned char *)block;
-	struct passwd *		passwd = 0;
-	struct group *		group = 0;
 	unsigned int		i;
 	long				sum;
 	long				checksum;
 
-	if ( *h->UserName )
-		passwd = getpwnam(h->UserName);
-	if ( *h->GroupName )
-		group = getgrnam(h->GroupName);
-
 	d->Name = h->Name;
 	d->LinkName = h->LinkName;
 	d->Mode = (mode_t)OtoL(h->Mode, sizeof(h->Mode));
 	d->Size = (size_t)OtoL(h->Size, sizeof(h->Size));
 	d->ModTime = (time_t)OtoL(h->ModificationTime
 	 ,sizeof(h->ModificationTime));
-	d->Device = ((OtoL(h->MajorDevice, sizeof(h->MajorDevice)) & 0xff) << 8)
-	 | (OtoL(h->MinorDevice, sizeof(h->MinorDevice)) & 0xff);
+	d->Device = makedev(OtoL(h->MajorDevice, sizeof(h->MajorDevice))
+	 ,OtoL(h->MinorDevice, sizeof(h->MinorDevice)));
 	checksum = OtoL(h->Checksum, sizeof(h->Checksum));
 	d->UserID = (uid_t)OtoL(h->UserID, sizeof(h->UserID));
 	d->GroupID = (gid_t)OtoL(h->GroupID, sizeof(h->GroupID));
 	d->Type = (TarFileType)h->LinkFlag;
 
-	if ( passwd )
-		d->UserID = passwd->pw_uid;
+	if ( lookUpNames && *h->UserName )
+		user_id(h->UserName, &d->UserID);
+
+	if ( lookUpNames && *h->GroupName )
+		group_id(h->GroupName, &d->GroupID);
 
-	if ( group )
-		d->GroupID = group->gr_gid;
+	/* The mode holds only the permissions; mknod() wants the type too. */
+	if ( (d->Mode & S_IFMT) == 0 ) {
+		switch ( d->Type ) {
+		case CharacterDevice:
+			d->Mode |= S_IFCHR;
+			break;
+		case BlockDevice:
+			d->Mode |= S_IFBLK;
+			break;
+		case FIFO:
+			d->Mode |= S_IFIFO;
+			break;
+		default:
+			break;
+		}
+	}
 
-	
 	sum = ' ' * sizeof(h->Checksum);/* Treat checksum field as all blank */
 	for ( i = TarChecksumOffset; i > 0; i-- )
 		sum += *s++;
@@ -98,20 +130,63 @@ DecodeTarHeader(char * block, TarInfo * d)
 }
 
 extern int
-TarExtractor(
+DecodeTarHeader(char * block, TarInfo * d)
+{
+	return Decode(block, d, 1);
+}
+
+/*
+ * For a caller that has no use for the owners, or wants the IDs as they
+ * are in the archive.
+ */
+extern int
+DecodeNumericTarHeader(char * block, TarInfo * d)
+{
+	return Decode(block, d, 0);
+}
+
+/*
+ * Read the data of a GNU long name record, which is the name itself.
+ */
+static char *
+ReadLongName(
+ void *			userData
+,const TarFunctions *	functions
+,size_t			size)
+{
+	size_t	length = (size + 511) & ~511;
+	char *	name;
+	size_t	done;
+
+	if ( size == 0 || size > PATH_MAX * 4 || (name = malloc(length)) == 0 )
+		return 0;
+	for ( done = 0; done < length; done += 512 ) {
+		if ( functions->Read(userData, &name[done], 512) != 512 ) {
+			free(name);
+			return 0;
+		}
+	}
+	name[size - 1] = '\0';
+	return name;
+}
+
+static int
+Extract(
  void *			userData
 ,const TarFunctions *	functions)
 {
 	int	status;
 	char	buffer[512];
 	TarInfo	h;
+	char *	longName = 0;
+	char *	longLinkName = 0;
 
 	h.UserData = userData;
 
 	while ( (status = functions->Read(userData, buffer, 512)) == 512 ) {
 		int	nameLength;
 
-		if ( !DecodeTarHeader(buffer, &h) ) {
+		if ( !Decode(buffer, &h, !functions->NumericOwner) ) {
 			if ( h.Name[0] == '\0' ) {
 				return 0;	/* End of tape */
 			} else {
@@ -124,6 +199,29 @@ TarExtractor(
 			return -1;	/* Bad header data */
 		}
 
+		if ( h.Type == LongName || h.Type == LongLinkName ) {
+			char *	name = ReadLongName(userData, functions, h.Size);
+
+			if ( name == 0 ) {
+				errno = 0;	/* Indicates broken tarfile */
+				status = -1;
+				break;
+			}
+			if ( h.Type == LongName ) {
+				free(longName);
+				longName = name;
+			}
+			else {
+				free(longLinkName);
+				longLinkName = name;
+			}
+			continue;
+		}
+		if ( longName )
+			h.Name = longName;
+		if ( longLinkName )
+			h.LinkName = longLinkName;
+
 		nameLength = strlen(h.Name);
 
 		switch ( h.Type ) {
@@ -152,11 +250,17 @@ TarExtractor(
 			break;
 		default:
 			errno = 0;	/* Indicates broken tarfile */
-			return -1;	/* Bad header field */
+			status = -1;	/* Bad header field */
+			break;
 		}
+		free(longName);
+		free(longLinkName);
+		longName = longLinkName = 0;
 		if ( status != 0 )
 			return status;	/* Pass on status from coroutine */
 	}
+	free(longName);
+	free(longLinkName);
 	if ( status > 0 ) {	/* Read partial header record */
 		errno = 0;	/* Indicates broken tarfile */
 		return -1;
@@ -164,3 +268,391 @@ TarExtractor(
 		return status;	/* Whatever I/O function returned */
 	}
 }
+
+/*
+ * Long-to-octal-ASCII, filling the field and ending it with a NUL. A
+ * number with too many digits is stored in base-256.
+ */
+static void
+LtoO(char * s, int size, unsigned long long n)
+{
+	int	i;
+
+	if ( n < (1ULL << (3 * (size - 1))) ) {
+		sprintf(s, "%0*llo", size - 1, n);
+		return;
+	}
+	for ( i = size - 1; i > 0; i-- ) {
+		s[i] = n & 0xff;
+		n >>= 8;
+	}
+	s[0] = 0x80;
+}
+
+/*
+ * The opposite of DecodeTarHeader(). Names longer than the fields are
+ * cut short; the caller writes long name records for them first.
+ */
+extern void
+EncodeTarHeader(char * block, const TarInfo * d)
+{
+	TarHeader *		h = (TarHeader *)block;
+	unsigned char *	s = (unsigned char *)block;
+	const char *	name;
+	unsigned int	sum = 0;
+	int				i;
+
+	memset(block, 0, 512);
+	strncpy(h->Name, d->Name, sizeof(h->Name));
+	LtoO(h->Mode, sizeof(h->Mode), d->Mode & 07777);
+	LtoO(h->UserID, sizeof(h->UserID), d->UserID);
+	LtoO(h->GroupID, sizeof(h->GroupID), d->GroupID);
+	LtoO(h->Size, sizeof(h->Size), d->Size);
+	LtoO(h->ModificationTime, sizeof(h->ModificationTime)
+	 ,d->ModTime > 0 ? d->ModTime : 0);
+	h->LinkFlag = d->Type;
+	if ( d->LinkName )
+		strncpy(h->LinkName, d->LinkName, sizeof(h->LinkName));
+	memcpy(h->MagicNumber, "ustar  ", 8);
+	if ( (name = user_name(d->UserID)) != 0 )
+		strncpy(h->UserName, name, sizeof(h->UserName) - 1);
+	if ( (name = group_name(d->GroupID)) != 0 )
+		strncpy(h->GroupName, name, sizeof(h->GroupName) - 1);
+	if ( d->Type == CharacterDevice || d->Type == BlockDevice ) {
+		LtoO(h->MajorDevice, sizeof(h->MajorDevice), major(d->Device));
+		LtoO(h->MinorDevice, sizeof(h->MinorDevice), minor(d->Device));
+	}
+
+	memset(h->Checksum, ' ', sizeof(h->Checksum));
+	for ( i = 0; i < 512; i++ )
+		sum += *s++;
+	sprintf(h->Checksum, "%06o", sum);
+}
+
+/*
+ * The archive being written. Headers and small files are gathered in a
+ * large aligned buffer, and go out in whole-buffer writes. The bodies of
+ * larger files go straight from file to archive through the copy engine,
+ * which uses copy_file_range(), sendfile() or splice() where it can.
+ */
+#define	TAR_BUFFER_SIZE	(1024 * 1024)
+#define	TAR_DIRECT_SIZE	(64 * 1024)	/* Bigger bodies bypass the buffer */
+
+struct TarOutput {
+	int		fd;
+	char *	buffer;
+	long	length;
+	struct HardLinks *
+			links;
+	dev_t	device;		/* Of the archive itself, so we leave it out */
+	ino_t	inode;
+	int		status;
+};
+
+static struct TarOutput	output;
+
+static int
+Flush(void)
+{
+	long	done = 0;
+
+	while ( done < output.length ) {
+		long	n = write(output.fd, &output.buffer[done], output.length - done);
+
+		if ( n < 0 && errno == EINTR )
+			continue;
+		if ( n <= 0 )
+			return -1;
+		done += n;
+	}
+	output.length = 0;
+	return 0;
+}
+
+/*
+ * Make room for "length" bytes at the end of the buffer, and return them.
+ */
+static char *
+Reserve(long length)
+{
+	if ( output.length + length > TAR_BUFFER_SIZE && Flush() != 0 )
+		return 0;
+	return &output.buffer[output.length];
+}
+
+static int
+PutZeros(long long length)
+{
+	while ( length > 0 ) {
+		long	n = length < TAR_BUFFER_SIZE ? length : TAR_BUFFER_SIZE;
+		char *	b = Reserve(n);
+
+		if ( b == 0 )
+			return -1;
+		memset(b, 0, n);
+		output.length += n;
+		length -= n;
+	}
+	return 0;
+}
+
+/*
+ * A GNU long name record, holding "name" for the header that follows.
+ */
+static int
+PutLongName(TarFileType type, const char * name)
+{
+	long	length = strlen(name) + 1;
+	TarInfo	d;
+	char *	b;
+
+	memset(&d, 0, sizeof(d));
+	d.Name = (char *)LongNameRecord;
+	d.Type = type;
+	d.Size = length;
+	if ( (b = Reserve(512)) == 0 )
+		return -1;
+	EncodeTarHeader(b, &d);
+	output.length += 512;
+	while ( length > 0 ) {
+		long	n = length < 512 ? length : 512;
+
+		if ( (b = Reserve(512)) == 0 )
+			return -1;
+		memset(b, 0, 512);
+		memcpy(b, name, n);
+		output.length += 512;
+		name += n;
+		length -= n;
+	}
+	return 0;
+}
+
+static int
+PutHeader(const TarInfo * d)
+{
+	char *	b;
+
+	if ( strlen(d->Name) >= 100 && PutLongName(LongName, d->Name) != 0 )
+		return -1;
+	if ( d->LinkName && strlen(d->LinkName) >= 100
+	 && PutLongName(LongLinkName, d->LinkName) != 0 )
+		return -1;
+	if ( (b = Reserve(512)) == 0 )
+		return -1;
+	EncodeTarHeader(b, d);
+	output.length += 512;
+	return 0;
+}
+
+/*
+ * Write "size" bytes of the file open on "fd", and the padding after
+ * them. A file that has shrunk since it was stat()ed is padded out with
+ * zeros, so that the archive still matches its header.
+ */
+static int
+PutBody(int fd, long long size, const char * name)
+{
+	long long	padding = (512 - size % 512) % 512;
+	long long	copied = 0;
+
+	if ( size <= TAR_DIRECT_SIZE ) {
+		char *	b = Reserve(size + padding);
+
+		if ( b == 0 )
+			return -1;
+		while ( copied < size ) {
+			long	n = read(fd, &b[copied], size - copied);
+
+			if ( n < 0 && errno == EINTR )
+				continue;
+			if ( n < 0 ) {
+				name_and_error(name);
+				output.status = 1;
+			}
+			if ( n <= 0 )
+				break;
+			copied += n;
+		}
+		output.length += copied;
+	}
+	else {
+		if ( Flush() != 0 )
+			return -1;
+		if ( (copied = copy_data(fd, output.fd, size)) < 0 ) {
+			/* A failed read of a file leaves the archive short. */
+			return -1;
+		}
+	}
+	if ( copied < size ) {
+		fprintf(stderr, "%s: file shrank by %lld bytes; padding with zeros\n"
+		 ,name, size - copied);
+		output.status = 1;
+	}
+	return PutZeros(size - copied + padding);
+}
+
+/*
+ * Called by descend() for each file, and for the files named on the
+ * command line.
+ */
+static int
+AddFile(const struct FileInfo * i)
+{
+	const char *	name = i->source;
+	char *			directoryName = 0;
+	char			link[PATH_MAX + 1];
+	struct stat		s = i->stat;
+	TarInfo			d;
+	int				fd = -1;
+	int				status = 0;
+
+	while ( *name == '/' )
+		name++;
+	if ( *name == '\0' )
+		name = ".";
+
+	if ( i->isSymbolicLink
+	 && fstatat(i->directoryFd, i->name, &s, AT_SYMLINK_NOFOLLOW) != 0 ) {
+		name_and_error(i->source);
+		output.status = 1;
+		return 0;
+	}
+	if ( s.st_dev == output.device && s.st_ino == output.inode )
+		return 0;
+
+	memset(&d, 0, sizeof(d));
+	d.Name = (char *)name;
+	d.Mode = s.st_mode;
+	d.ModTime = s.st_mtime;
+	d.UserID = s.st_uid;
+	d.GroupID = s.st_gid;
+
+	switch ( s.st_mode & S_IFMT ) {
+	case S_IFREG:
+		if ( s.st_nlink > 1 && output.links
+		 && (d.LinkName = (char *)hard_link_find(output.links, &s, name)) ) {
+			d.Type = HardLink;
+			break;
+		}
+		if ( (fd = openat(i->directoryFd, i->name, O_RDONLY|O_NOFOLLOW)) < 0 ) {
+			name_and_error(i->source);
+			output.status = 1;
+			return 0;
+		}
+		d.Type = NormalFile1;
+		d.Size = s.st_size;
+		break;
+	case S_IFDIR:
+		if ( (directoryName = malloc(strlen(name) + 2)) == 0 )
+			return -1;
+		strcpy(directoryName, name);
+		if ( directoryName[strlen(name) - 1] != '/' )
+			strcat(directoryName, "/");
+		d.Name = directoryName;
+		d.Type = Directory;
+		break;
+	case S_IFLNK: {
+		long	n = readlinkat(i->directoryFd, i->name, link, sizeof(link) - 1);
+
+		if ( n < 0 ) {
+			name_and_error(i->source);
+			output.status = 1;
+			return 0;
+		}
+		link[n] = '\0';
+		d.LinkName = link;
+		d.Type = SymbolicLink;
+		break;
+	}
+	case S_IFCHR:
+		d.Type = CharacterDevice;
+		d.Device = s.st_rdev;
+		break;
+	case S_IFBLK:
+		d.Type = BlockDevice;
+		d.Device = s.st_rdev;
+		break;
+	case S_IFIFO:
+		d.Type = FIFO;
+		break;
+	default:
+		fprintf(stderr, "%s: socket ignored\n", i->source);
+		return 0;
+	}
+
+	if ( PutHeader(&d) != 0 || (fd >= 0 && PutBody(fd, d.Size, i->source) != 0) )
+		status = -1;
+	if ( fd >= 0 )
+		close(fd);
+	free(directoryName);
+	return status;
+}
+
+/*
+ * Write an archive of the files named in "names", and of everything in
+ * the directories among them, to "fd". Later links to a file already in
+ * the archive are stored as hard links to it. Returns 0, 1 if some files
+ * couldn't be read, or -1 with errno set if the archive couldn't be
+ * written.
+ */
+extern int
+TarCreator(int fd, struct FileInfo * i, char * * names)
+{
+	struct stat	s;
+	int			status = 0;
+
+	memset(&output, 0, sizeof(output));
+	output.fd = fd;
+	if ( fstat(fd, &s) == 0 && S_ISREG(s.st_mode) ) {
+		output.device = s.st_dev;
+		output.inode = s.st_ino;
+	}
+	if ( posix_memalign((void * *)&output.buffer, 4096, TAR_BUFFER_SIZE) != 0 )
+		return -1;
+	output.links = hard_links_create();
+	i->options->recursive = 1;
+
+	for ( ; *names && status >= 0; names++ ) {
+		i->source = i->destination = *names;
+		i->directoryFd = i->destinationFd = AT_FDCWD;
+		i->name = i->destinationName = *names;
+		if ( stat_entry(AT_FDCWD, *names, DT_UNKNOWN, i) != 0 ) {
+			name_and_error(*names);
+			output.status = 1;
+			continue;
+		}
+		if ( !i->isSymbolicLink && S_ISDIR(i->stat.st_mode) )
+			status = descend(i, AddFile);
+		else
+			status = AddFile(i);
+		if ( status > 0 ) {
+			output.status = 1;
+			status = 0;
+		}
+	}
+
+	/* Two blocks of zeros end the archive. */
+	if ( status == 0 && (PutZeros(1024) != 0 || Flush() != 0) )
+		status = -1;
+
+	free(output.buffer);
+	if ( output.links )
+		hard_links_free(output.links);
+	return status < 0 ? -1 : output.status;
+}
+
+/*
+ * The names in the archive are looked up once each, for as long as the
+ * extraction lasts.
+ */
+extern int
+TarExtractor(
+ void *			userData
+,const TarFunctions *	functions)
+{
+	int	status = Extract(userData, functions);
+
+	id_cache_free();
+	return status;
+}
@@ -2,7 +2,7 @@
 #define	_TAR_FUNCTION_H_
 
 /*
- * Functions for extracting tar archives.
+ * Functions for extracting and creating tar archives.
  * Bruce Perens, April-May 1995
  * Copyright (C) 1995 Bruce Perens
  * This is free software under the GNU General Public License.
@@ -20,7 +20,9 @@ enum TarFileType {
 	CharacterDevice = '3',
 	BlockDevice = '4',
 	Directory = '5',
-	FIFO = '6'
+	FIFO = '6',
+	LongLinkName = 'K',	/* GNU: the link name of the next header */
+	LongName = 'L'		/* GNU: the name of the next header */
 };
 typedef enum TarFileType	TarFileType;
 
@@ -49,10 +51,16 @@ struct TarFunctions {
 	TarFunction	MakeHardLink;
 	TarFunction	MakeSymbolicLink;
 	TarFunction	MakeSpecialFile;
+	int		NumericOwner;	/* Don't look up the owners' names */
 };
 typedef struct TarFunctions	TarFunctions;
 
+struct FileInfo;
+
 extern int	DecodeTarHeader(char * block, TarInfo * d);
+extern int	DecodeNumericTarHeader(char * block, TarInfo * d);
+extern void	EncodeTarHeader(char * block, const TarInfo * d);
 extern int	TarExtractor(void * userData, const TarFunctions * functions);
+extern int	TarCreator(int fd, struct FileInfo * i, char * * names);
 
 #endif
@@ -1,15 +1,22 @@
 #include "internal.h"
 #include <sys/types.h>
-#include <utime.h>
+#include <fcntl.h>
 
 const char	touch_usage[] = "touch file [file ...]\n"
 "\n"
 "\tUpdate the last-modified date on the given file[s].\n";
 
+extern int
+touch_main(struct FileInfo * i, int argc, char * * argv)
+{
+	i->options->unsorted = 1;
+	return monadic_main(i, argc, argv);
+}
+
 extern int
 touch_fn(const struct FileInfo * i)
 {
-	if ( utime(i->source, 0) ) {
+	if ( utimensat(i->directoryFd, i->name, 0, 0) ) {
 		name_and_error(i->source);
 		return 1;
 	}
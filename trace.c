@@ -0,0 +1,328 @@
+#include "internal.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+
+/*
+ * Count the I/O and metadata calls the applets make. The Makefile links
+ * with "ld --wrap" for each call listed in TRACED when BB_TRACE is
+ * defined, so that a call to read() from any of our objects comes here
+ * as __wrap_read(), and __real_read() is the C library's. Calls the C
+ * library makes internally, as for stdio, are not seen. Without BB_TRACE
+ * none of this is compiled or linked.
+ *
+ * pread() and pwrite() count as reads and writes. Copies the kernel makes
+ * from one descriptor to another, with copy_file_range(), sendfile() or
+ * splice(), count as "copy", with the bytes they move.
+ *
+ * If BUSYBOX_TRACE is set when the program exits, a line for each kind
+ * of call is written to the file it names, or to the standard error if
+ * it is empty or "-".
+ */
+
+enum TraceCall {
+	TraceRead,
+	TraceWrite,
+	TraceCopy,
+	TraceOpen,
+	TraceClose,
+	TraceStat,
+	TraceMkdir,
+	TraceUnlink,
+	TraceChmod,
+	TraceChown,
+	TraceCalls
+};
+
+static const char * const	callNames[TraceCalls] = {
+	"read", "write", "copy", "open", "close", "stat", "mkdir", "unlink", "chmod", "chown"
+};
+
+struct Counter {
+	unsigned long	calls;
+	unsigned long	errors;
+	unsigned long	bytes;
+	unsigned long	nanoseconds;
+};
+
+static struct Counter	counters[TraceCalls];
+
+static void
+begin(struct timespec * start)
+{
+	clock_gettime(CLOCK_MONOTONIC, start);
+}
+
+static void
+end(enum TraceCall call, const struct timespec * start, long result, int bytes)
+{
+	struct Counter *	c = &counters[call];
+	struct timespec		t;
+	int					error = errno;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	__sync_fetch_and_add(&c->calls, 1);
+	__sync_fetch_and_add(&c->nanoseconds
+	 ,(t.tv_sec - start->tv_sec) * 1000000000UL + t.tv_nsec - start->tv_nsec);
+	if ( result < 0 )
+		__sync_fetch_and_add(&c->errors, 1);
+	else if ( bytes )
+		__sync_fetch_and_add(&c->bytes, result);
+	errno = error;
+}
+
+static void
+report(void)
+{
+	const char *	name = getenv("BUSYBOX_TRACE");
+	FILE *			f = stderr;
+	int				n;
+
+	if ( name == 0 )
+		return;
+	if ( *name != '\0' && strcmp(name, "-") != 0 ) {
+		if ( (f = fopen(name, "a")) == 0 )
+			return;
+	}
+	for ( n = 0; n < TraceCalls; n++ ) {
+		const struct Counter *	c = &counters[n];
+
+		if ( c->calls == 0 )
+			continue;
+		fprintf(f, "trace: applet=%s pid=%d call=%s calls=%lu errors=%lu"
+		 " bytes=%lu microseconds=%lu\n"
+		 ,program_invocation_short_name
+		 ,(int)getpid()
+		 ,callNames[n]
+		 ,c->calls
+		 ,c->errors
+		 ,c->bytes
+		 ,c->nanoseconds / 1000);
+	}
+	if ( f != stderr )
+		fclose(f);
+}
+
+static void __attribute__((constructor))
+start_trace(void)
+{
+	atexit(report);
+}
+
+#define	TRACE(call, bytes, type, real)	\
+	{									\
+		struct timespec	start;			\
+		type			result;			\
+										\
+		begin(&start);					\
+		result = real;					\
+		end(call, &start, (long)result, bytes);	\
+		return result;					\
+	}
+
+extern ssize_t	__real_read(int fd, void * buffer, size_t length);
+extern ssize_t	__real_write(int fd, const void * buffer, size_t length);
+extern ssize_t	__real_pread(int fd, void * buffer, size_t length, off_t offset);
+extern ssize_t	__real_pwrite(int fd, const void * buffer, size_t length, off_t offset);
+extern ssize_t	__real_pwritev2(
+				 int fd
+				,const struct iovec * v
+				,int count
+				,off_t offset
+				,int flags);
+extern ssize_t	__real_copy_file_range(
+				 int in
+				,loff_t * inOffset
+				,int out
+				,loff_t * outOffset
+				,size_t length
+				,unsigned int flags);
+extern ssize_t	__real_sendfile(int out, int in, off_t * offset, size_t length);
+extern ssize_t	__real_splice(
+				 int in
+				,loff_t * inOffset
+				,int out
+				,loff_t * outOffset
+				,size_t length
+				,unsigned int flags);
+extern int		__real_open(const char * name, int flags, ...);
+extern int		__real_openat(int fd, const char * name, int flags, ...);
+extern int		__real_creat(const char * name, mode_t mode);
+extern int		__real_close(int fd);
+extern int		__real_stat(const char * name, struct stat * s);
+extern int		__real_lstat(const char * name, struct stat * s);
+extern int		__real_fstat(int fd, struct stat * s);
+extern int		__real_fstatat(int fd, const char * name, struct stat * s, int flags);
+extern int		__real_mkdir(const char * name, mode_t mode);
+extern int		__real_mkdirat(int fd, const char * name, mode_t mode);
+extern int		__real_unlink(const char * name);
+extern int		__real_unlinkat(int fd, const char * name, int flags);
+extern int		__real_rmdir(const char * name);
+extern int		__real_chmod(const char * name, mode_t mode);
+extern int		__real_fchmod(int fd, mode_t mode);
+extern int		__real_fchmodat(int fd, const char * name, mode_t mode, int flags);
+extern int		__real_chown(const char * name, uid_t uid, gid_t gid);
+extern int		__real_lchown(const char * name, uid_t uid, gid_t gid);
+extern int		__real_fchown(int fd, uid_t uid, gid_t gid);
+extern int		__real_fchownat(
+				 int fd
+				,const char * name
+				,uid_t uid
+				,gid_t gid
+				,int flags);
+
+extern ssize_t
+__wrap_read(int fd, void * buffer, size_t length)
+TRACE(TraceRead, 1, ssize_t, __real_read(fd, buffer, length))
+
+extern ssize_t
+__wrap_write(int fd, const void * buffer, size_t length)
+TRACE(TraceWrite, 1, ssize_t, __real_write(fd, buffer, length))
+
+extern ssize_t
+__wrap_pread(int fd, void * buffer, size_t length, off_t offset)
+TRACE(TraceRead, 1, ssize_t, __real_pread(fd, buffer, length, offset))
+
+extern ssize_t
+__wrap_pwrite(int fd, const void * buffer, size_t length, off_t offset)
+TRACE(TraceWrite, 1, ssize_t, __real_pwrite(fd, buffer, length, offset))
+
+extern ssize_t
+__wrap_pwritev2(int fd, const struct iovec * v, int count, off_t offset, int flags)
+TRACE(TraceWrite, 1, ssize_t, __real_pwritev2(fd, v, count, offset, flags))
+
+extern ssize_t
+__wrap_copy_file_range(
+ int in
+,loff_t * inOffset
+,int out
+,loff_t * outOffset
+,size_t length
+,unsigned int flags)
+TRACE(TraceCopy, 1, ssize_t
+ ,__real_copy_file_range(in, inOffset, out, outOffset, length, flags))
+
+extern ssize_t
+__wrap_sendfile(int out, int in, off_t * offset, size_t length)
+TRACE(TraceCopy, 1, ssize_t, __real_sendfile(out, in, offset, length))
+
+extern ssize_t
+__wrap_splice(
+ int in
+,loff_t * inOffset
+,int out
+,loff_t * outOffset
+,size_t length
+,unsigned int flags)
+TRACE(TraceCopy, 1, ssize_t
+ ,__real_splice(in, inOffset, out, outOffset, length, flags))
+
+/* The mode is only there when the file might be created. */
+static mode_t
+open_mode(int flags, va_list arguments)
+{
+	if ( (flags & O_CREAT) || (flags & O_TMPFILE) == O_TMPFILE )
+		return va_arg(arguments, mode_t);
+	return 0;
+}
+
+extern int
+__wrap_open(const char * name, int flags, ...)
+{
+	va_list	arguments;
+	mode_t	mode;
+
+	va_start(arguments, flags);
+	mode = open_mode(flags, arguments);
+	va_end(arguments);
+	TRACE(TraceOpen, 0, int, __real_open(name, flags, mode))
+}
+
+extern int
+__wrap_openat(int fd, const char * name, int flags, ...)
+{
+	va_list	arguments;
+	mode_t	mode;
+
+	va_start(arguments, flags);
+	mode = open_mode(flags, arguments);
+	va_end(arguments);
+	TRACE(TraceOpen, 0, int, __real_openat(fd, name, flags, mode))
+}
+
+extern int
+__wrap_creat(const char * name, mode_t mode)
+TRACE(TraceOpen, 0, int, __real_creat(name, mode))
+
+extern int
+__wrap_close(int fd)
+TRACE(TraceClose, 0, int, __real_close(fd))
+
+extern int
+__wrap_stat(const char * name, struct stat * s)
+TRACE(TraceStat, 0, int, __real_stat(name, s))
+
+extern int
+__wrap_lstat(const char * name, struct stat * s)
+TRACE(TraceStat, 0, int, __real_lstat(name, s))
+
+extern int
+__wrap_fstat(int fd, struct stat * s)
+TRACE(TraceStat, 0, int, __real_fstat(fd, s))
+
+extern int
+__wrap_fstatat(int fd, const char * name, struct stat * s, int flags)
+TRACE(TraceStat, 0, int, __real_fstatat(fd, name, s, flags))
+
+extern int
+__wrap_mkdir(const char * name, mode_t mode)
+TRACE(TraceMkdir, 0, int, __real_mkdir(name, mode))
+
+extern int
+__wrap_mkdirat(int fd, const char * name, mode_t mode)
+TRACE(TraceMkdir, 0, int, __real_mkdirat(fd, name, mode))
+
+extern int
+__wrap_unlink(const char * name)
+TRACE(TraceUnlink, 0, int, __real_unlink(name))
+
+extern int
+__wrap_unlinkat(int fd, const char * name, int flags)
+TRACE(TraceUnlink, 0, int, __real_unlinkat(fd, name, flags))
+
+extern int
+__wrap_rmdir(const char * name)
+TRACE(TraceUnlink, 0, int, __real_rmdir(name))
+
+extern int
+__wrap_chmod(const char * name, mode_t mode)
+TRACE(TraceChmod, 0, int, __real_chmod(name, mode))
+
+extern int
+__wrap_fchmod(int fd, mode_t mode)
+TRACE(TraceChmod, 0, int, __real_fchmod(fd, mode))
+
+extern int
+__wrap_fchmodat(int fd, const char * name, mode_t mode, int flags)
+TRACE(TraceChmod, 0, int, __real_fchmodat(fd, name, mode, flags))
+
+extern int
+__wrap_chown(const char * name, uid_t uid, gid_t gid)
+TRACE(TraceChown, 0, int, __real_chown(name, uid, gid))
+
+extern int
+__wrap_lchown(const char * name, uid_t uid, gid_t gid)
+TRACE(TraceChown, 0, int, __real_lchown(name, uid, gid))
+
+extern int
+__wrap_fchown(int fd, uid_t uid, gid_t gid)
+TRACE(TraceChown, 0, int, __real_fchown(fd, uid, gid))
+
+extern int
+__wrap_fchownat(int fd, const char * name, uid_t uid, gid_t gid, int flags)
+TRACE(TraceChown, 0, int, __real_fchownat(fd, name, uid, gid, flags))
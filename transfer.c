@@ -0,0 +1,163 @@
+#include "internal.h"
+#include <stdio.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+
+/*
+ * Count what a copy has moved, and report it while the copy goes on.
+ * transfer_start() blocks SIGUSR1 in the calling thread, and so in any
+ * thread it starts afterwards, and starts a reporter thread that waits
+ * for the signal. Each SIGUSR1 prints the counts so far; with "progress"
+ * set, a line with the rate is also rewritten every second. Nothing is
+ * printed from a signal handler.
+ *
+ * The counters are read by the reporter while the copy runs. A counter
+ * bumped by more than one thread must be updated with transfer_add().
+ */
+
+#define	INTERVAL	1		/* Second between progress reports */
+
+static double
+elapsed(const struct timespec * start, const struct timespec * now)
+{
+	return (now->tv_sec - start->tv_sec)
+	 + (now->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+extern double
+transfer_seconds(const struct TransferStats * t)
+{
+	struct timespec	now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return elapsed(&t->start, &now);
+}
+
+extern void
+transfer_add(unsigned long long * counter, unsigned long long n)
+{
+	__sync_fetch_and_add(counter, n);
+}
+
+/*
+ * Print the counts, and the bytes moved, the time taken and the rate.
+ */
+extern void
+transfer_report(struct TransferStats * t)
+{
+	unsigned long long	bytes = t->bytes;
+	double				seconds = transfer_seconds(t);
+
+	flockfile(stderr);
+	if ( t->printed ) {
+		fputc('\n', stderr);
+		t->printed = 0;
+	}
+	if ( t->records ) {
+		fprintf(stderr, "%llu+%llu records in\n", t->fullIn, t->partialIn);
+		fprintf(stderr, "%llu+%llu records out\n", t->fullOut, t->partialOut);
+	}
+	fprintf(stderr, "%llu bytes copied, %.3f s, %.1f MB/s\n"
+	,bytes
+	,seconds
+	,seconds > 0 ? bytes / seconds / 1e6 : 0.0);
+	funlockfile(stderr);
+}
+
+/*
+ * The progress line, with the average rate and the rate over the last
+ * interval.
+ */
+static void
+progress(struct TransferStats * t, unsigned long long * last, struct timespec * then)
+{
+	unsigned long long	bytes = t->bytes;
+	struct timespec		now;
+	double				seconds;
+	double				interval;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	seconds = elapsed(&t->start, &now);
+	interval = elapsed(then, &now);
+	flockfile(stderr);
+	fprintf(stderr, "\r%llu bytes copied, %.0f s, %.1f MB/s, now %.1f MB/s   "
+	,bytes
+	,seconds
+	,seconds > 0 ? bytes / seconds / 1e6 : 0.0
+	,interval > 0 ? (bytes - *last) / interval / 1e6 : 0.0);
+	t->printed = 1;
+	funlockfile(stderr);
+	*last = bytes;
+	*then = now;
+}
+
+static void *
+reporter(void * argument)
+{
+	struct TransferStats *	t = (struct TransferStats *)argument;
+	struct timespec			timeout;
+	struct timespec			then = t->start;
+	unsigned long long		last = 0;
+	sigset_t				set;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	timeout.tv_sec = INTERVAL;
+	timeout.tv_nsec = 0;
+	for ( ; ; ) {
+		int	signal = sigtimedwait(&set, 0, t->progress ? &timeout : 0);
+
+		if ( t->stopping )
+			break;
+		if ( signal == SIGUSR1 )
+			transfer_report(t);
+		else if ( signal < 0 && errno == EAGAIN )
+			progress(t, &last, &then);
+	}
+	return 0;
+}
+
+extern int
+transfer_start(struct TransferStats * t)
+{
+	sigset_t	set;
+
+	clock_gettime(CLOCK_MONOTONIC, &t->start);
+	t->stopping = 0;
+	t->printed = 0;
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	if ( pthread_sigmask(SIG_BLOCK, &set, &t->mask) != 0 )
+		return -1;
+	if ( pthread_create(&t->reporter, 0, reporter, t) != 0 ) {
+		pthread_sigmask(SIG_SETMASK, &t->mask, 0);
+		return -1;
+	}
+	t->running = 1;
+	return 0;
+}
+
+/*
+ * Stop the reporter. A SIGUSR1 that comes in the meantime is taken, so
+ * that it doesn't kill us once the signal is unblocked.
+ */
+extern void
+transfer_finish(struct TransferStats * t)
+{
+	struct timespec	none = { 0, 0 };
+	sigset_t		set;
+
+	if ( !t->running )
+		return;
+	t->stopping = 1;
+	pthread_kill(t->reporter, SIGUSR1);
+	pthread_join(t->reporter, 0);
+	t->running = 0;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	while ( sigtimedwait(&set, 0, &none) == SIGUSR1 )
+		;
+	pthread_sigmask(SIG_SETMASK, &t->mask, 0);
+}
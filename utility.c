@@ -44,3 +44,33 @@ join_paths(char * buffer, const char * a, const char * b)
 	}
 	return buffer;
 }
+
+/*
+ * Add "/name" to the end of the path, and return the old length so that
+ * the caller can cut it back off with path_truncate().
+ */
+extern int
+path_append(struct PathBuffer * p, const char * name)
+{
+	int	old = p->length;
+	int	length = strlen(name);
+
+	if ( p->length + length + 2 > p->size ) {
+		p->size = (p->length + length + 2) * 2;
+		if ( p->size < 256 )
+			p->size = 256;
+		p->path = realloc(p->path, p->size);
+	}
+	if ( p->length > 0 && p->path[p->length - 1] != '/' )
+		p->path[p->length++] = '/';
+	memcpy(&p->path[p->length], name, length + 1);
+	p->length += length;
+	return old;
+}
+
+extern void
+path_truncate(struct PathBuffer * p, int length)
+{
+	p->length = length;
+	p->path[length] = '\0';
+}